@@ -4,12 +4,27 @@
 #define MSG_SIZE 32
 #define LOCALHOST "127.0.0.1"
 #define TIMEOUT 180
+#define MAX_FRAME_SEATS ((MAX_FRAME_SIZE - sizeof(uint64_t) - sizeof(uint32_t)) / sizeof(uint32_t))
 
 
 
 // method signatures
 void send0();
 void receive3();
+bool want_retry();
+bool send_hello();
+void book_frames();
+void book_best();
+void choose_show();
+bool select_show(uint32_t number);
+char *receive_result(uint32_t *len);
+void show_map();
+void refresh_map();
+void watch_map();
+bool update_map(int type, const char *payload, uint32_t len);
+void operations();
+void list_bookings();
+void resume_session();
 bool want_cancel();
 void user_access();
 void setup_events();
@@ -17,6 +32,13 @@ void receive1(int *n, int *m);
 void check_semaphore_state();
 void get_user_info(long choice);
 int receive_seats_map(int n, int m);
+int print_seats_map(char *map, int n, int m);
+void print_queue_state(long position, long estimate);
+void print_booking_failure(int result);
+void send_frame(int type, const char *payload, uint32_t len);
+char *receive_frame(int *type, uint32_t *len);
+char *decode_map(const char *data, const char *end, int encoding, int seats);
+bool apply_delta(char *map, const char *data, const char *end, int count, int seats);
 long get_port(int argc, char *argv[]);
 bool check_email_format(char *email);
 bool send2(int n, int m);
@@ -29,6 +51,16 @@ void startup_connection(long port, char *address);
 // variabili globali
 int conn_s = -2;                    // connection socket descriptor
 bool communicated = true;           // to check if the booking management went properly
+char map_version[VERSION_SIZE];     // version of the last seats map, sent back with the choice
+int protocol = PROTOCOL_V2;         // PROTOCOL_LEGACY if the server doesn't speak v2
+long server_port;
+char *server_address;
+char *credentials = NULL;           // v2: payload of the sign in, sent again if the session expires
+uint32_t credentials_len;
+char *known_map = NULL;             // v2: last seats map received, kept up to date with the deltas
+uint64_t known_version;
+int known_rows, known_cols;
+uint32_t show_number = 0;           // v2: show the operations work on, the first one by default
 
 
 
@@ -62,33 +94,40 @@ void event_handler(int signal){
 int main(int argc, char *argv[]){
     int n;              // # rows
     int m;              // # cols
-    long port;          // port number
-    char *address;      // ip address
     
     // retieve input's information
-    port = get_port(argc, argv);
-    address = get_address(argc, argv);
+    server_port = get_port(argc, argv);
+    server_address = get_address(argc, argv);
     
     // handling events
     setup_events();
     
     // initializing communication components
-    startup_connection(port, address);
+    startup_connection(server_port, server_address);
+    
+    // the servers not speaking v2 close the connection on the hello
+    if(send_hello() == false){
+        close(conn_s);
+        protocol = PROTOCOL_LEGACY;
+        startup_connection(server_port, server_address);
+    }
     
     // handle the access of user
     user_access();
     
+    // v2 keeps the connection for all the operations
+    if(protocol == PROTOCOL_V2)
+        operations();
     // handling the canceletion of the booking
-    if(want_cancel() == false){
+    else if(want_cancel() == false){
         receive1(&n, &m);
-        
+            
         if(send2(n, m))
             receive3();
         else
             // cancealing timer, because user doesn't
             // want insert any other seat (no "receive3")
             alarm(0);
-        
     } else {
         send0();
     }
@@ -193,6 +232,10 @@ void get_user_info(long choice){
     char *username; 
     char password[MAX_INPUT_SIZE];
     char server_answer = '1';
+    char frame[3 * (sizeof(uint16_t) + MAX_INPUT_SIZE)];
+    char *answer;
+    uint32_t len;
+    int type;
     int res;
     
     do{
@@ -206,8 +249,8 @@ void get_user_info(long choice){
             email = get_string("e-mail: ", MAX_INPUT_SIZE);
         }while(check_email_format(email) == false);
         
-        // sending the e-mail to the server
-        if((write(conn_s, email, MAX_INPUT_SIZE)) == -1)                                                // write -2.1.1
+        // sending the e-mail to the server, v2 sends the credentials all together
+        if(protocol == PROTOCOL_LEGACY && (write(conn_s, email, MAX_INPUT_SIZE)) == -1)                 // write -2.1.1
             error("write -2.1.1 failed");
         
         
@@ -218,7 +261,7 @@ void get_user_info(long choice){
             username = get_string("username: ", MAX_INPUT_SIZE);
             
             // sending the username to the server
-            if((write(conn_s, username, MAX_INPUT_SIZE)) == -1)                                         // write -2.1.2
+            if(protocol == PROTOCOL_LEGACY && (write(conn_s, username, MAX_INPUT_SIZE)) == -1)          // write -2.1.2
                 error("write -2.1.2 failed");
         }
             
@@ -230,6 +273,40 @@ void get_user_info(long choice){
             get_password(password);
         } while(strlen(password) < 8 && strlen(password) > MAX_INPUT_SIZE);
         
+        if(protocol == PROTOCOL_V2){
+            if(choice == WANT_TO_SIGN_UP)
+                len = put_str(put_str(put_str(frame, email), username), password) - frame;
+            else
+                len = put_str(put_str(frame, email), password) - frame;
+            
+            send_frame(choice == WANT_TO_SIGN_UP ? FRAME_SIGN_UP : FRAME_SIGN_IN, frame, len);
+            
+            if((answer = receive_frame(&type, &len)) == NULL || type != FRAME_ACCESS || len < 1)
+                raise(SIGUSR1);
+            
+            server_answer = answer[0] ? '1' : '0';
+            
+            // kept to sign in again on a new connection
+            if(server_answer == '1'){
+                credentials_len = put_str(put_str(frame, email), password) - frame;
+                
+                if((credentials = malloc(credentials_len)) == NULL)
+                    error("memory allocation failed.");
+                memcpy(credentials, frame, credentials_len);
+            }
+            
+            if(server_answer == '1' && choice == WANT_TO_SIGN_IN){
+                if((username = malloc(sizeof(char) * MAX_INPUT_SIZE)) == NULL)
+                    error("memory allocation failed.");
+                
+                if(get_str(answer + 1, answer + len, username) == NULL)
+                    raise(SIGUSR1);
+            }
+            
+            free(answer);
+            continue;
+        }
+        
         // sending the password to the server
         if((write(conn_s, password, MAX_INPUT_SIZE)) == -1)                                             // write -2.1.3
             error("write -2.1.3 failed");
@@ -275,22 +352,24 @@ void user_access(){
     
         switch(choice){
             case 1: //Sign in
-                // sending the choice to the server
-                if((write(conn_s, "1", sizeof(char))) == -1)                                     // write -2
+                // sending the choice to the server, v2 sends it with the credentials
+                if(protocol == PROTOCOL_LEGACY && (write(conn_s, "1", sizeof(char))) == -1)      // write -2
                     error("write -2 failed");
                 flag = true;
                 break; 
                 
             case 2: //Sign Up
-                // sending the choice to the server
-                if((write(conn_s, "2", sizeof(char))) == -1)                                     // write -2
+                // sending the choice to the server, v2 sends it with the credentials
+                if(protocol == PROTOCOL_LEGACY && (write(conn_s, "2", sizeof(char))) == -1)      // write -2
                     error("write -2 failed");
                 flag = true;
                 break;
                 
             case 3:
                 // sending the choice to the server
-                if((write(conn_s, "3", sizeof(char))) == -1)                                     // write -2
+                if(protocol == PROTOCOL_V2)
+                    send_frame(FRAME_BYE, NULL, 0);
+                else if((write(conn_s, "3", sizeof(char))) == -1)                                // write -2
                     error("write -2 failed");
                 
                 // we are closing the connection because otherwise
@@ -353,6 +432,9 @@ bool want_cancel(){
 void send0(){
     long code;
     char *buff;
+    char *answer;
+    uint32_t len;
+    int type;
     int res;
     
     if((buff = malloc((CODE_SIZE + 1) * sizeof(char))) == NULL)
@@ -368,17 +450,27 @@ void send0(){
     printf("sending %s to server\n", buff);
 #endif
     
-    // sending the code to the server
-    if((write(conn_s, buff, CODE_SIZE * sizeof(char))) == -1)                                               // write 0.1
-        error("write 0.1 failed");
-    
-    // reading the answer from the server
-    res = read(conn_s, buff, sizeof(char));                                                              // read 0.2
-    
-    if(res == -1){
-        error("read 0.2 failed.");
-    } else if(res == 0)
-        raise(SIGUSR1);
+    if(protocol == PROTOCOL_V2){
+        send_frame(FRAME_CANCEL, buff, CODE_SIZE * sizeof(char));
+        
+        if((answer = receive_frame(&type, &len)) == NULL || type != FRAME_CANCEL_RESULT || len != 1)
+            raise(SIGUSR1);
+        
+        buff[0] = answer[0] ? '1' : '0';
+        free(answer);
+    } else {
+        // sending the code to the server
+        if((write(conn_s, buff, CODE_SIZE * sizeof(char))) == -1)                                           // write 0.1
+            error("write 0.1 failed");
+        
+        // reading the answer from the server
+        res = read(conn_s, buff, sizeof(char));                                                          // read 0.2
+        
+        if(res == -1){
+            error("read 0.2 failed.");
+        } else if(res == 0)
+            raise(SIGUSR1);
+    }
     
     
     
@@ -436,17 +528,47 @@ void receive1(int *n, int *m){
 
 
 int receive_seats_map(int n, int m){
+    int res;
+    char *map;
+    
+    if((map = malloc(n * m * sizeof(char))) == NULL)
+        error("memory allocation failed.");
+    
+    // reads the whole map at once
+    res = recv(conn_s, map, n * m * sizeof(char), MSG_WAITALL);                 // read 3
+    
+    if(res == -1){
+        error("read 3 failed.");
+    } else if(res != n * m)
+        raise(SIGUSR1);
+    
+    
+    // the version of the map just received
+    res = recv(conn_s, map_version, VERSION_SIZE, MSG_WAITALL);              // read 3.1
+    
+    if(res == -1){
+        error("read 3.1 failed.");
+    } else if(res != VERSION_SIZE)
+        raise(SIGUSR1);
+    
+    res = print_seats_map(map, n, m);
+    free(map);
+    
+    // no seats available, nothing else to do
+    if(res == 0)
+        raise(SIGINT);
+    
+    return res;
+}
+
+
+
+// prints the map ('0' for each free seat), returns the number of free seats
+int print_seats_map(char *map, int n, int m){
     int seats_free = 0;                             // number of available seats
     ssize_t seat_len;                               // max # of digits for seats number
-    int res;
     char *temp;                                     // temporary buffer for printing seats map with padding
-    char *buff;                                                 // temporary array
-        
-        
-        
-        
-    if((buff = malloc(m*sizeof(char))) == NULL)
-        error("memory allocation failed.");
+    char *buff;                                     // current row
     
     
     // printing the seats map
@@ -472,14 +594,7 @@ int receive_seats_map(int n, int m){
     
     
     for(int i=0; i<n; i++){
-        // reads one complete row from server
-        res = read(conn_s, buff, m*sizeof(char));               // read 3
-    
-        if(res == -1){
-            error("read 3 failed.");
-        } else if(res == 0)
-            raise(SIGUSR1);
-        
+        buff = map + i * m;
         
         printf("ROW -> %d\t", i + 1);
         
@@ -533,7 +648,7 @@ int receive_seats_map(int n, int m){
         printf("WARNING: no seats available.\n");
         printf("\033[97m");                         // reset color to white
         
-        raise(SIGINT);
+        return 0;
     }
     
     // it is initialized to true, because if there are no seats available
@@ -550,7 +665,9 @@ int receive_seats_map(int n, int m){
 bool send2(int n, int m){
     int seats_free;                             // number of available seats
     char *redundancy;                                           // flag to check about seats booked multiple times
-    char *buff;                                                 // temporary array
+    char *buff = NULL;                                          // temporary array
+    char *batch;                                                // the whole choice, sent at once
+    ssize_t batch_len;
     char *msg;                                                  // variable to handle parametrized messages
     int seat;                                                   // used for user input, stores the seat
     int res;
@@ -599,9 +716,15 @@ bool send2(int n, int m){
 #endif
         
         
-        // sending seats number to server
-        if((write(conn_s, buff, book_size)) == -1)                                     // write 4
-            error("write 4 failed");
+        // the number of seats, the map version and the seats are sent with one write
+        if((batch = malloc(book_size + VERSION_SIZE + bookings * seat_size)) == NULL)
+            error("memory allocation failed");
+        
+        memcpy(batch, buff, book_size);                                                 // write 4
+        
+        // telling the server which map the seats are chosen from
+        memcpy(batch + book_size, map_version, VERSION_SIZE);                           // write 4.1
+        batch_len = book_size + VERSION_SIZE;
         
         // to avoid duplicates
         if((redundancy = malloc(sizeof(char) * (n * m))) == NULL)
@@ -632,13 +755,18 @@ bool send2(int n, int m){
             }
             
             redundancy[seat - 1] = '1';
-            snprintf(buff, log10(seat) + 2, "%d", seat);
-    
-            // sending the seat to server
-            if((write(conn_s, buff, log10(seat) + 2)) == -1)                       // write 5
-                error("write 5 failed");
+            snprintf(batch + batch_len, log10(seat) + 2, "%d", seat);                   // write 5
+            batch_len += log10(seat) + 2;
         }
         
+        // sending the choice to server
+        if((write(conn_s, batch, batch_len)) == -1)                                     // write 4, 4.1 and 5
+            error("write 5 failed");
+        
+        free(batch);
+        free(redundancy);
+        free(msg);
+        
         
         
         // check for the round
@@ -662,32 +790,9 @@ bool send2(int n, int m){
 #endif
 
         if (atoi(buff) != 0) {
-            switch(atoi(buff)) {
-                case 1:
-                    printf("Selected seats are not available together\n");
-                    break;
-                    
-                default:
-                    printf("Generic error code %s\n", buff);
-                    break;
-            }
-            
-            
-            while(strcmp(buff, "y") != 0 && strcmp(buff, "Y") != 0 && strcmp(buff, "n") != 0 && strcmp(buff, "N") != 0){
-                printf("Retry? (y/n)\n");
-                fflush(stdout);
-                
-                scanf("%s", buff);
-                
-#ifdef DEBUG
-                printf("buff: %s\n", buff);
-                printf("size of buff: %ld\n", strlen(buff));
-#endif
-                
-                // getchar needs to avoid the trailing '\n'
-                getchar();
-            }
+            print_booking_failure(atoi(buff));
             
+            buff[0] = want_retry() ? 'y' : 'n';
             
             // sending to server the decision of user to re-enter seats
             if((write(conn_s, buff, sizeof(char))) == -1)                          // write 7
@@ -735,20 +840,17 @@ void receive3(){
 }
 
 
+// while the server keeps the client in queue it sends the state '0'
+// followed by the position and the estimated waiting time (ms), and
+// the state '1' once the seats can be checked
 void check_semaphore_state(){
     char buff;
-    int counter = 0;
-    
-    if((read(conn_s, &buff, sizeof(char))) == -1)            // read semaphore state
-        error("read semaphore state failed.");
+    char fields[2 * QUEUE_FIELD_SIZE];
+    time_t start = time(NULL);
+    bool waited = false;
     
     // endless check about server availability
-    fflush(stdout);
-    
-    while(buff == '0'){
-        printf("|");
-        fflush(stdout);
-        
+    while(true){
         redo752:
         if((read(conn_s, &buff, sizeof(char))) == -1){            // read semaphore state
             if(errno != EINTR){
@@ -757,10 +859,708 @@ void check_semaphore_state(){
                 goto redo752;
         }
         
-        counter++;
+        if(buff != '0')
+            break;
+        
+        if((recv(conn_s, fields, sizeof(fields), MSG_WAITALL)) != sizeof(fields))          // read queue state
+            error("read queue state failed.");
+        
+        fields[QUEUE_FIELD_SIZE - 1] = '\0';
+        fields[2 * QUEUE_FIELD_SIZE - 1] = '\0';
+        
+        print_queue_state(atol(fields), atol(fields + QUEUE_FIELD_SIZE));
+        
+        waited = true;
+    }
+    
+    if (waited)
+        printf("\nWaiting time: %ld sec\n", (long) (time(NULL) - start));
+}
+
+
+void print_queue_state(long position, long estimate){
+    printf("\rPosition in queue: %ld, estimated wait: %.1f sec    ", position, estimate / 1000.0);
+    fflush(stdout);
+}
+
+
+void print_booking_failure(int result){
+    switch(result) {
+        case BOOK_RESULT_TAKEN:
+            printf("Selected seats are not available together\n");
+            break;
+            
+        case BOOK_RESULT_STALE:
+            printf("Selected seats have been taken meanwhile, the map has changed\n");
+            break;
+            
+        default:
+            printf("Generic error code %d\n", result);
+            break;
+    }
+}
+
+
+bool want_retry(){
+    char buff[MSG_SIZE] = "";
+    
+    while(strcmp(buff, "y") != 0 && strcmp(buff, "Y") != 0 && strcmp(buff, "n") != 0 && strcmp(buff, "N") != 0){
+        printf("Retry? (y/n)\n");
+        fflush(stdout);
+        
+        if(scanf("%31s", buff) != 1)
+            raise(SIGUSR1);
+        
+#ifdef DEBUG
+        printf("buff: %s\n", buff);
+        printf("size of buff: %ld\n", strlen(buff));
+#endif
+        
+        // getchar needs to avoid the trailing '\n'
+        getchar();
+    }
+    
+    return buff[0] == 'y' || buff[0] == 'Y';
+}
+
+
+// opens the v2 conversation, false if the server doesn't speak it
+bool send_hello(){
+    char hello[1 + FRAME_HEADER_SIZE + 2];
+    char answer[FRAME_HEADER_SIZE + 2];
+    char *payload;
+    
+    hello[0] = PROTOCOL_MAGIC;
+    payload = put_frame_header(hello + 1, FRAME_HELLO, 2 * sizeof(char));
+    payload[0] = PROTOCOL_V2;
+    payload[1] = MAP_ENCODING_BITMAP | MAP_ENCODING_RLE;
+    
+    if((write(conn_s, hello, sizeof(hello))) == -1)                                     // write hello
+        error("write hello failed");
+    
+    if(recv(conn_s, answer, sizeof(answer), MSG_WAITALL) != sizeof(answer))            // read hello
+        return false;
+    
+    return answer[0] == FRAME_HELLO && get_u32(answer + 1) == 2 && answer[FRAME_HEADER_SIZE] == PROTOCOL_V2;
+}
+
+
+// decodes the map in one pass, into '0' or '1' for each seat; NULL if it is malformed
+char *decode_map(const char *data, const char *end, int encoding, int seats){
+    char *map;
+    char current = '0';
+    uint32_t run;
+    int decoded = 0;
+    
+    if((map = malloc(seats * sizeof(char))) == NULL)
+        error("memory allocation failed");
+    
+    switch(encoding){
+        case MAP_ENCODING_RAW:
+            if(end - data != seats)
+                break;
+            
+            memcpy(map, data, seats);
+            return map;
+            
+        case MAP_ENCODING_BITMAP:
+            if(end - data != (seats + 7) / 8)
+                break;
+            
+            for(int i=0; i<seats; i++)
+                map[i] = data[i / 8] & (1 << i % 8) ? '1' : '0';
+            return map;
+            
+        case MAP_ENCODING_RLE:
+            while(data < end){
+                if((data = get_varint(data, end, &run)) == NULL || run > (uint32_t) (seats - decoded))
+                    break;
+                
+                memset(map + decoded, current, run);
+                decoded += run;
+                current = current == '0' ? '1' : '0';
+            }
+            
+            if(data != end || decoded != seats)
+                break;
+            return map;
+    }
+    
+    free(map);
+    return NULL;
+}
+
+
+// applies in order the flips of a delta map, false if it is malformed
+bool apply_delta(char *map, const char *data, const char *end, int count, int seats){
+    uint32_t flip;
+    
+    for(int i=0; i<count; i++){
+        if((data = get_varint(data, end, &flip)) == NULL || flip / 2 < 1 || flip / 2 > (uint32_t) seats)
+            return false;
+        
+        map[flip / 2 - 1] = flip % 2 ? '1' : '0';
+    }
+    
+    return data == end;
+}
+
+
+// sends the frame with a single write
+void send_frame(int type, const char *payload, uint32_t len){
+    char *frame;
+    
+    if((frame = malloc(FRAME_HEADER_SIZE + len)) == NULL)
+        error("memory allocation failed");
+    
+    if(len > 0)
+        memcpy(put_frame_header(frame, type, len), payload, len);
+    else
+        put_frame_header(frame, type, len);
+    
+    if((write(conn_s, frame, FRAME_HEADER_SIZE + len)) == -1)
+        error("write frame failed");
+    
+    free(frame);
+}
+
+
+// returns the payload of the next frame, NULL if the server closed the connection
+char *receive_frame(int *type, uint32_t *len){
+    char header[FRAME_HEADER_SIZE];
+    char *payload;
+    ssize_t res;
+    
+    redo_header:
+    if((res = recv(conn_s, header, FRAME_HEADER_SIZE, MSG_WAITALL)) == -1){
+        if(errno == EINTR)
+            goto redo_header;
+        error("read frame failed.");
+    } else if(res != FRAME_HEADER_SIZE)
+        return NULL;
+    
+    *type = (unsigned char) header[0];
+    *len = get_u32(header + 1);
+    
+    if((payload = malloc(*len + 1)) == NULL)
+        error("memory allocation failed");
+    
+    if(*len > 0 && recv(conn_s, payload, *len, MSG_WAITALL) != *len){
+        free(payload);
+        return NULL;
+    }
+    
+    return payload;
+}
+
+
+// v2: the operations run one after the other on the same connection,
+// until the user exits
+void operations(){
+    long choice;
+    char *message = "What do you want to do?\n\n\t1) Show seats map\n\t2) Book seats\n\t3) Cancel booking\n\t4) List bookings\n\t5) Watch seats map\n\t6) Book the best available seats\n\t7) Choose the show\n\t8) Exit\nEnter a code: ";
+    
+    while(true){
+        choice = get_long(message);
+        
+        if(choice >= 1 && choice <= 7)
+            resume_session();
+        
+        switch(choice){
+            case 1:
+                show_map();
+                break;
+                
+            case 2:
+                book_frames();
+                break;
+                
+            case 3:
+                send0();
+                break;
+                
+            case 4:
+                list_bookings();
+                break;
+                
+            case 5:
+                watch_map();
+                break;
+                
+            case 6:
+                book_best();
+                break;
+                
+            case 7:
+                choose_show();
+                break;
+                
+            case 8:
+                send_frame(FRAME_BYE, NULL, 0);
+                return;
+                
+            default:
+                system("clear");
+                puts("Warning, invalid input");
+                break;
+        }
+    }
+}
+
+
+// the server closes the idle sessions: in that case the user is
+// signed in again on a new connection, on the same show, and the
+// known map is still valid
+void resume_session(){
+    struct pollfd pfd = { .fd = conn_s, .events = POLLIN };
+    char probe;
+    char *answer;
+    uint32_t len;
+    int type;
+    
+    // nothing comes from the server between the operations, but its closing
+    if(poll(&pfd, 1, 0) == 0 || recv(conn_s, &probe, sizeof(char), MSG_PEEK | MSG_DONTWAIT) > 0)
+        return;
+    
+    puts("Session expired, signing in again...");
+    
+    close(conn_s);
+    startup_connection(server_port, server_address);
+    
+    if(send_hello() == false)
+        raise(SIGUSR1);
+    
+    send_frame(FRAME_SIGN_IN, credentials, credentials_len);
+    
+    if((answer = receive_frame(&type, &len)) == NULL || type != FRAME_ACCESS || len < 1 || answer[0] == 0)
+        raise(SIGUSR1);
+    
+    free(answer);
+    
+    if(show_number != 0 && select_show(show_number) == false)
+        raise(SIGUSR1);
+}
+
+
+// v2: lists the shows, the following operations work on the chosen one
+void choose_show(){
+    char *payload;
+    const char *field;
+    uint32_t len;
+    uint32_t count;
+    long choice;
+    int type;
+    
+    send_frame(FRAME_SHOWS, NULL, 0);
+    
+    if((payload = receive_frame(&type, &len)) == NULL || type != FRAME_SHOWS || len < sizeof(uint32_t))
+        raise(SIGUSR1);
+    
+    count = get_u32(payload);
+    
+    if(len != sizeof(uint32_t) * (1 + 3 * count))
+        raise(SIGUSR1);
+    
+    field = payload + sizeof(uint32_t);
+    for(uint32_t i=0; i<count; i++, field += 3 * sizeof(uint32_t))
+        printf("\t%u) %u rows, %u columns, %u free seats%s\n", i + 1, get_u32(field), get_u32(field + sizeof(uint32_t)),
+            get_u32(field + 2 * sizeof(uint32_t)), i == show_number ? " (current)" : "");
+    
+    free(payload);
+    
+    do{
+        choice = get_long("\nEnter the show ('0' to keep the current one): ");
+    } while(choice < 0 || choice > (long) count);
+    
+    if(choice == 0 || (uint32_t) choice - 1 == show_number)
+        return;
+    
+    if(select_show(choice - 1) == false){
+        puts("The show can't be chosen now");
+        return;
+    }
+    
+    show_number = choice - 1;
+    
+    // the map known is the one of the previous show
+    free(known_map);
+    known_map = NULL;
+}
+
+
+// v2: the next operations work on the given show, false if refused
+bool select_show(uint32_t number){
+    char frame[sizeof(uint32_t)];
+    char *answer;
+    uint32_t len;
+    int type;
+    bool selected;
+    
+    put_u32(frame, number);
+    send_frame(FRAME_SHOW, frame, sizeof(frame));
+    
+    if((answer = receive_frame(&type, &len)) == NULL || type != FRAME_SHOW || len != 1)
+        raise(SIGUSR1);
+    
+    selected = answer[0] != 0;
+    free(answer);
+    
+    return selected;
+}
+
+
+// v2: requests the seats map, only the seats changed meanwhile once one is known
+void refresh_map(){
+    char known[sizeof(uint64_t)];
+    char *payload;
+    uint32_t len;
+    int type;
+    
+    if(known_map == NULL)
+        send_frame(FRAME_MAP_REQUEST, NULL, 0);
+    else {
+        put_u64(known, known_version);
+        send_frame(FRAME_MAP_REQUEST, known, sizeof(known));
+    }
+    
+    if((payload = receive_frame(&type, &len)) == NULL || !update_map(type, payload, len))
+        raise(SIGUSR1);
+    
+    free(payload);
+}
+
+
+// v2: the map is printed again at each change pushed by the server,
+// until the user presses enter
+void watch_map(){
+    struct pollfd pfds[2] = { { .fd = STDIN_FILENO, .events = POLLIN }, { .fd = conn_s, .events = POLLIN } };
+    char known[sizeof(uint64_t)];
+    char line[MSG_SIZE];
+    char *payload;
+    uint32_t len;
+    int type;
+    int res;
+    time_t pinged = time(NULL);
+    
+    if(known_map == NULL)
+        send_frame(FRAME_SUBSCRIBE, NULL, 0);
+    else {
+        put_u64(known, known_version);
+        send_frame(FRAME_SUBSCRIBE, known, sizeof(known));
+    }
+    
+    if((payload = receive_frame(&type, &len)) != NULL && type == FRAME_UNSUBSCRIBE){
+        free(payload);
+        puts("Too many users are watching the map, try again later");
+        communicated = true;
+        return;
+    }
+    
+    do{
+        if(payload == NULL || !update_map(type, payload, len))
+            raise(SIGUSR1);
+        free(payload);
+        
+        system("clear");
+        print_seats_map(known_map, known_rows, known_cols);
+        alarm(0);
+        
+        puts("\nPress enter to stop watching");
+        
+        // the server closes a subscriber silent for too long, pushes or not
+        do{
+            if(time(NULL) - pinged >= PING_INTERVAL){
+                send_frame(FRAME_PING, NULL, 0);
+                pinged = time(NULL);
+            }
+            
+            if((res = poll(pfds, 2, (PING_INTERVAL - (time(NULL) - pinged)) * 1000)) == -1 && errno != EINTR)
+                error("poll failed");
+        } while(res <= 0);
+        
+        if(pfds[1].revents != 0 && !(pfds[0].revents & POLLIN))
+            payload = receive_frame(&type, &len);
+    } while(!(pfds[0].revents & POLLIN));
+    
+    if(fgets(line, sizeof(line), stdin) == NULL)
+        raise(SIGUSR1);
+    
+    send_frame(FRAME_UNSUBSCRIBE, NULL, 0);
+    
+    // the changes pushed meanwhile come before the echo
+    while((payload = receive_frame(&type, &len)) != NULL && type != FRAME_UNSUBSCRIBE){
+        if(!update_map(type, payload, len))
+            raise(SIGUSR1);
+        free(payload);
+    }
+    
+    if(payload == NULL)
+        raise(SIGUSR1);
+    free(payload);
+    
+    communicated = true;
+}
+
+
+// updates the known map with a whole map or with a delta, false if the frame is neither
+bool update_map(int type, const char *payload, uint32_t len){
+    const size_t map_header = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+    const size_t delta_header = 2 * sizeof(uint32_t) + 2 * sizeof(uint64_t) + sizeof(uint32_t);
+    
+    if(type == FRAME_MAP && len > map_header){
+        known_rows = get_u32(payload);
+        known_cols = get_u32(payload + sizeof(uint32_t));
+        known_version = get_u64(payload + 2 * sizeof(uint32_t));
+        
+        free(known_map);
+        return (known_map = decode_map(payload + map_header + sizeof(char), payload + len, payload[map_header], known_rows * known_cols)) != NULL;
     }
-    if (counter > 0)
-        printf("\nWaiting time: %d sec\n", counter);
+    
+    if(type == FRAME_MAP_DELTA && len >= delta_header && known_map != NULL && get_u64(payload + 2 * sizeof(uint32_t)) == known_version){
+        if(!apply_delta(known_map, payload + delta_header, payload + len, get_u32(payload + delta_header - sizeof(uint32_t)), known_rows * known_cols))
+            return false;
+        
+        known_version = get_u64(payload + 2 * sizeof(uint32_t) + sizeof(uint64_t));
+        return true;
+    }
+    
+    return false;
+}
+
+
+void show_map(){
+    refresh_map();
+    print_seats_map(known_map, known_rows, known_cols);
+    
+    communicated = true;
+    alarm(0);
+}
+
+
+// v2: prints the bookings of the account, with their show and seats
+void list_bookings(){
+    char *payload;
+    const char *field;
+    const char *end;
+    uint32_t len;
+    uint32_t count;
+    uint32_t seats;
+    int type;
+    
+    send_frame(FRAME_LIST, NULL, 0);
+    
+    if((payload = receive_frame(&type, &len)) == NULL || type != FRAME_BOOKINGS || len < sizeof(uint32_t))
+        raise(SIGUSR1);
+    
+    count = get_u32(payload);
+    field = payload + sizeof(uint32_t);
+    end = payload + len;
+    
+    if(count == 0)
+        puts("No bookings");
+    
+    for(uint32_t i=0; i<count; i++){
+        if((size_t) (end - field) < CODE_SIZE + 2 * sizeof(uint32_t))
+            raise(SIGUSR1);
+        
+        seats = get_u32(field + CODE_SIZE + sizeof(uint32_t));
+        
+        if((size_t) (end - field) - CODE_SIZE - 2 * sizeof(uint32_t) < seats * sizeof(uint32_t))
+            raise(SIGUSR1);
+        
+        printf("%.*s, show %u, seats:", CODE_SIZE, field, get_u32(field + CODE_SIZE) + 1);
+        field += CODE_SIZE + 2 * sizeof(uint32_t);
+        
+        for(uint32_t j=0; j<seats; j++, field += sizeof(uint32_t))
+            printf(" %u", get_u32(field));
+        puts("");
+    }
+    
+    free(payload);
+}
+
+
+// v2 booking: the whole choice is sent in one frame and
+// the answer comes back after the queue states
+void book_frames(){
+    char *frame;
+    char *payload;
+    char *redundancy;                           // flag to check about seats booked multiple times
+    char msg[MSG_SIZE];
+    char *end;
+    uint32_t len;
+    int n, m;
+    int seat;
+    int seats_free;
+    long bookings;
+    bool retry = false;
+    
+    do{
+        // after the first one, only the seats changed meanwhile are received
+        refresh_map();
+        n = known_rows;
+        m = known_cols;
+        
+        if((seats_free = print_seats_map(known_map, n, m)) == 0)
+            break;
+        
+        // retrieving # of seats
+        do{
+            bookings = get_long("\nEnter the number of seats to book ('0' included): ");
+        } while(bookings < 0 || bookings > seats_free || bookings > (long) MAX_FRAME_SEATS);
+        
+        if(bookings == 0)
+            break;
+        
+        if((frame = malloc(MAX_FRAME_SIZE)) == NULL || (redundancy = calloc(n * m, sizeof(char))) == NULL)
+            error("memory allocation failed");
+        
+        // the map version goes back with the choice
+        end = put_u64(frame, known_version);
+        end = put_u32(end, bookings);
+        
+        for(int i=0; i<bookings; i++){
+            snprintf(msg, MSG_SIZE * sizeof(char), "Enter the %d° seat:", i + 1);
+            seat = get_long(msg);
+            
+            // checking the boundaries
+            if(seat < 1 || seat > n*m){
+                printf("Please, enter a number between 1 and %d\n", (n*m));
+                fflush(stdout);
+                i--;
+                continue;
+            }
+            
+            // checking the seat avaiability
+            if(redundancy[seat - 1] != '\0'){
+                puts("Seat already entered\n");
+                i--;
+                continue;
+            }
+            
+            redundancy[seat - 1] = '1';
+            end = put_u32(end, seat);
+        }
+        
+        send_frame(FRAME_BOOK, frame, end - frame);
+        free(redundancy);
+        free(frame);
+        
+        payload = receive_result(&len);
+        
+        if(payload[0] == BOOK_RESULT_BOOKED && len == 1 + CODE_SIZE){
+            printf("Operations succeded.\n");
+            printf("*************************************************\n");
+            printf("*\t YOUR BOOKING CODE IS: %.*s \t*\n", CODE_SIZE, payload + 1);
+            printf("*************************************************\n");
+            
+            retry = false;
+        } else {
+            print_booking_failure(payload[0]);
+            retry = want_retry();
+        }
+        
+        free(payload);
+    } while(retry);
+    
+    communicated = true;
+    
+    // canceling the alarm for ending the booking path
+    alarm(0);
+}
+
+
+// v2: the server picks the seats, the user gives only how many and where
+void book_best(){
+    char frame[3 * sizeof(uint32_t) + sizeof(char)];
+    char buff[MSG_SIZE] = "";
+    char *payload;
+    char *field;
+    uint32_t len;
+    long bookings;
+    long first_row, last_row;
+    
+    refresh_map();
+    
+    do{
+        bookings = get_long("\nEnter the number of seats to book ('0' included): ");
+    } while(bookings < 0 || bookings > (long) known_rows * known_cols);
+    
+    if(bookings == 0)
+        return;
+    
+    while(strcmp(buff, "y") != 0 && strcmp(buff, "Y") != 0 && strcmp(buff, "n") != 0 && strcmp(buff, "N") != 0){
+        printf("Side by side? (y/n)\n");
+        fflush(stdout);
+        
+        if(scanf("%31s", buff) != 1)
+            raise(SIGUSR1);
+        
+        // getchar needs to avoid the trailing '\n'
+        getchar();
+    }
+    
+    // rows from 1, '0' for any
+    do{
+        first_row = get_long("\nEnter the first row you like ('0' for any): ");
+        last_row = get_long("\nEnter the last row you like ('0' for any): ");
+    } while(first_row < 0 || last_row < 0 || first_row > known_rows || last_row > known_rows || (first_row && last_row && first_row > last_row));
+    
+    if((buff[0] == 'y' || buff[0] == 'Y') && bookings > known_cols){
+        printf("A row has only %d seats\n", known_cols);
+        return;
+    }
+    
+    field = put_u32(frame, bookings);
+    *field++ = buff[0] == 'y' || buff[0] == 'Y';
+    field = put_u32(field, first_row);
+    put_u32(field, last_row);
+    
+    send_frame(FRAME_BOOK_BEST, frame, sizeof(frame));
+    
+    payload = receive_result(&len);
+    
+    if(payload[0] == BOOK_RESULT_BOOKED && len == 1 + CODE_SIZE + sizeof(uint32_t) * (bookings + 1)){
+        printf("Operations succeded, your seats:");
+        
+        field = payload + 1 + CODE_SIZE + sizeof(uint32_t);
+        for(long i=0; i<bookings; i++, field += sizeof(uint32_t))
+            printf(" %u", get_u32(field));
+        
+        printf("\n*************************************************\n");
+        printf("*\t YOUR BOOKING CODE IS: %.*s \t*\n", CODE_SIZE, payload + 1);
+        printf("*************************************************\n");
+    } else
+        puts("There aren't so many free seats there");
+    
+    free(payload);
+    
+    communicated = true;
+    alarm(0);
+}
+
+
+// v2: the server keeps sending the queue state until the seats are checked,
+// then the result of the booking
+char *receive_result(uint32_t *len){
+    char *payload;
+    int type;
+    bool waited = false;
+    time_t start = time(NULL);
+    
+    while((payload = receive_frame(&type, len)) != NULL && type == FRAME_QUEUE && *len == 2 * sizeof(uint32_t)){
+        print_queue_state(get_u32(payload), get_u32(payload + sizeof(uint32_t)));
+        free(payload);
+        waited = true;
+    }
+    
+    if (waited)
+        printf("\nWaiting time: %ld sec\n", (long) (time(NULL) - start));
+    
+    if(payload == NULL || type != FRAME_RESULT || *len < 1)
+        raise(SIGUSR1);
+    
+    return payload;
 }
 
 
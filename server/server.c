@@ -1,100 +1,523 @@
 #include "../utils/utils.h"
 
-#define BACKLOG 10
+#define BACKLOG 10                          // default, -b sets it
 #define SEATS_FILE_NAME "cinema_struct"
 #define BOOKING_FILE_NAME "booking_struct"
+#define MAX_SHOWS 64
+#define SHOW_FILE_NAME_SIZE 32              // files of a show, the name of the first show's ones followed by '_' and its number
 #define ACCOUNTS_FILE_NAME "accounts"
 #define NUM_ERR 1
 #define MAX_ACCOUNT_LINE_SIZE 1024
-
-#define BOOKING_CRITICAL_SECTION_INDEX 0
-#define SIGNUP_CRITICAL_SECTION_INDEX 1
-#define DELETING_CRITICAL_SECTION_INDEX 2
+#define ACCOUNT_SHARDS 64                   // locks of the accounts index, a power of two
+#define ACCOUNT_SHARD_BUCKETS 256           // initial buckets of a shard, doubled when it fills up
+#define ARENA_BLOCK_SIZE (64 * 1024)        // the accounts of a shard are carved out of blocks this big
+
+#define DELETING_CRITICAL_SECTION_INDEX 1
+#define SEATS_PER_STRIPE(show) ((show)->m)  // a stripe covers one whole row of the hall
+#define QUEUE_HEARTBEAT 10                  // seconds between queue state refreshes sent to a waiting client
+#define CHANGE_LOG_SIZE 4096                // last seat flips kept to send the delta maps
+#define BEST_ATTEMPTS 4                     // picks of a best seats request, before giving up to the conflicts
+#define CODE_SPACE 9000000000ULL            // codes of ten digits, from 1000000000 on
+#define CODE_HALF_BITS 17                   // the permutation works on 34 bits, the smallest even width above the space
+#define CODE_ROUNDS 4                       // of the Feistel network
+#define CODE_BLOCK 256                      // codes a thread takes from the shared counter at once
+
+#define BOOKING_ENGINE_LOCKING 1            // seats checked and booked holding the rows' stripes
+#define BOOKING_ENGINE_OPTIMISTIC 2         // seats claimed one by one with compare-and-swap
+#define SERVER_USAGE "USAGE: ./server [-p <PORT_NUMBER>] [-e <locking|optimistic>] [-m <threads|epoll|uring>] [-l <EVENT_LOOPS>] [-w <WORKERS>] [-a <LISTENERS>] [-b <BACKLOG>] [-s <SHOWS>]"
+
+#define SERVER_MODE_THREADS 1               // one thread per connection, blocking on each message
+#define SERVER_MODE_EPOLL 2                 // connections driven as state machines by a few event loops
+#define SERVER_MODE_URING 3                 // as epoll, but the loops accept, read and write through io_uring
+#define MAX_LISTENERS 64
+#define MAX_BACKLOG 65535                   // the kernel caps it anyway at net.core.somaxconn
+#define MAX_EVENT_LOOPS 64
+#define MAX_EVENTS 64                       // events handled by an event loop for each epoll_wait
+#define SESSION_TIMEOUT 120                 // seconds of inactivity before closing a session, as SO_RCVTIMEO
+#define SESSION_BUFFER_SIZE (FRAME_HEADER_SIZE + MAX_FRAME_SIZE)     // pending input of a session, greater than any message
+
+#define URING_ENTRIES 256                   // submission queue size of each loop
+#define URING_SESSIONS 1024                 // sessions of each io_uring loop, each one with a registered buffer
+#define URING_READ 1                        // kind of operation, in the low bits of the user data
+#define URING_SEND 2
+#define URING_ACCEPT 3
+#define URING_TICK 4
+#define URING_WAKE 5
+#define URING_OP_MASK 7
+
+#define WORKERS_PER_CORE 16                 // sessions block on the client, so a core serves many workers
+#define MAX_WORKERS 4096
+#define WORKER_STACK_SIZE (256 * 1024)
+#define WORKER_QUEUE_SIZE 4                 // connections each worker can keep waiting
+#define PARK_DELAY 50                       // ms an idle session keeps its worker before being parked
+
+// steps of the conversation with a client, named after the message they wait for
+#define STATE_ACCESS 0                      // read -2
+#define STATE_EMAIL 1                       // read -2.1.1
+#define STATE_USERNAME 2                    // read -2.1.2
+#define STATE_PASSWORD 3                    // read -2.1.3
+#define STATE_DECISION 4                    // read -1
+#define STATE_CODE 5                        // read 0.1
+#define STATE_BOOKINGS 6                    // read 4
+#define STATE_VERSION 7                     // read 4.1
+#define STATE_SEAT 8                        // read 5
+#define STATE_LOCKING 9                     // nothing to read, queued on the rows of the booking
+#define STATE_RETRY 10                      // read 7
+#define STATE_CLOSING 11                    // nothing to read, closed once the output is sent
+#define STATE_HELLO 12                      // v2: read FRAME_HELLO
 
 
 
 
 typedef struct thread_arguments{
-    char * code;
     int conn_s;
+    struct session *session;                // resumed from the parking, NULL for a new connection
 } t_args;
 
 
-typedef struct reservation{
-    char *code;
-    struct reservation *next;
-} reservation_t;
+// worker of the pool, with its own deque of connections waiting to be served;
+// an idle worker sleeps on its own condition variable
+typedef struct worker{
+    pthread_t tid;
+    struct event_loop *loop;                // the one of its sessions, for the wakeups and the I/O counters
+    pthread_mutex_t mutex;
+    pthread_cond_t work_available;
+    bool idle;
+    t_args *deque[WORKER_QUEUE_SIZE];       // circular buffer
+    int first;
+    int count;
+} worker_t;
+
+
+// the counters are atomic, the mutex only parks the accept loops while all the deques are full
+typedef struct worker_pool{
+    worker_t *workers;
+    int size;
+    pthread_mutex_t mutex;
+    pthread_cond_t space_available;
+    int waiting;                            // accept loops waiting for a free slot
+    int pending;                            // connections in the deques or on their way, not claimed by any worker
+    int busy;                               // workers serving a connection
+    unsigned next;                          // first deque tried by the next submission
+    bool saturated;
+} worker_pool_t;
+
+
+struct session;
+
+
+// waiting session, queued in FIFO order on a stripe
+typedef struct stripe_waiter{
+    struct session *session;                // woken up on its loop when the queue moves
+    bool granted;                           // ownership handed off by the previous holder
+    long ticket;
+    struct stripe_waiter *next;
+} stripe_waiter_t;
+
+
+// flip of a seat, in the change log
+typedef struct change{
+    unsigned long version;                  // version of the map it belongs to
+    int seat;
+    bool taken;
+} change_t;
+
+
+// lock protecting a row of the hall, handed off to waiters in arrival order
+typedef struct stripe{
+    pthread_mutex_t mutex;
+    bool busy;
+    stripe_waiter_t *head;
+    stripe_waiter_t *tail;
+    long next_ticket;                       // ticket of the next session that will queue
+    long served;                            // tickets already granted
+    long avg_hold_ms;                       // moving average of the holding time
+    struct timespec acquired_at;
+    int max_run;                            // longest run of free seats of the row, updated under the mutex
+} stripe_t;
+
+
+struct event_loop;
+
+
+// conversation with a client, one state per protocol step: it is driven
+// by an event loop or by a worker thread, and it can be suspended
+// while waiting for a row without keeping any thread busy
+typedef struct session{
+    int conn_s;
+    int state;
+    int protocol;                           // PROTOCOL_LEGACY until the client opens with PROTOCOL_MAGIC
+    int map_encodings;                      // v2: map encodings the client decodes, besides the raw one
+    int access_type;
+    char email[MAX_INPUT_SIZE];
+    char username[MAX_INPUT_SIZE];
+    struct person *account;
+    struct show *show;                      // the seats operations work on
+    int *seats_array;
+    int bookings;
+    int received;                           // seats already received
+    unsigned long version;                  // version of the map the client is choosing from
+    bool stale;                             // the map changed since the client got it
+    bool best;                              // v2: the server picks the seats
+    bool adjacent;                          // of the best seats request
+    int first_row;
+    int last_row;
+    int attempts;                           // picks of the best seats request
+    int *rows;                              // rows of the booking, in ascending order
+    int rows_count;
+    int rows_held;                          // rows already acquired
+    bool waiting;                           // queued on the stripe of rows[rows_held]
+    stripe_waiter_t waiter;
+    long sent_position;                     // last position in queue sent to the client
+    bool wake_pending;                      // in the loop's list of sessions to resume
+    struct session *wake_next;
+    bool subscribed;                        // v2: the seat changes are pushed to the client
+    unsigned long pushed_version;           // version of the map the subscribed client has
+    bool push_deferred;                     // a slow client gets the pushes coalesced once its output drains
+    struct session *sub_prev;               // in the subscribers list
+    struct session *sub_next;
+    char *in;                               // received bytes not yet consumed
+    size_t in_start;
+    size_t in_len;
+    char *out;                              // bytes still to be sent
+    size_t out_len;
+    size_t out_sent;
+    size_t out_size;
+    bool want_write;                        // epoll: waiting for EPOLLOUT
+    int slot;                               // io_uring: registered input buffer, -1 if not registered
+    int inflight;                           // io_uring: operations submitted and not completed yet
+    bool writing;                           // io_uring: a send is in flight
+    bool closed;                            // io_uring: freed once the inflight operations complete
+    char *sending;                          // io_uring: output handed to the kernel
+    size_t sending_len;
+    size_t sending_sent;
+    size_t sending_size;
+    time_t last_activity;
+    struct event_loop *loop;
+    struct session *prev;                   // sessions of a loop, from the least recently active
+    struct session *next;
+} session_t;
+
+
+// io_uring instance, accessed through its mmapped rings
+typedef struct uring{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;                 // prepared entries are published on submission
+    unsigned to_submit;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_t;
+
+
+typedef struct event_loop{
+    pthread_t tid;
+    int epfd;                               // epoll
+    uring_t ring;
+    char *buffers;                          // io_uring: input buffers of the sessions
+    bool fixed_buffers;                     // io_uring: buffers registered with the ring
+    int *free_slots;
+    int free_count;
+    struct __kernel_timespec tick;
+    bool single_accept;                     // io_uring: the kernel has no multishot accept
+    uint64_t accepts_paused;                // io_uring: listeners to rearm at the next tick, a bit each
+    time_t accepts_retry;                   // io_uring: not before this second
+    unsigned long syscalls;
+    unsigned long bookings;
+    unsigned long writes;                   // pieces of output gathered by session_write()
+    unsigned long sends;                    // send syscalls flushing them
+    int wake_fd;                            // eventfd, written by the threads waking sessions up
+    uint64_t wake_value;                    // io_uring: target of the eventfd read
+    pthread_mutex_t wake_mutex;
+    session_t *woken;                       // sessions to resume, in no particular order
+    session_t *oldest;
+    session_t *newest;
+} event_loop_t;
+
+
+// listening socket bound with SO_REUSEPORT: the kernel spreads the
+// connections over the listeners, each one with its own accept loop
+typedef struct listener{
+    pthread_t tid;
+    int index;
+    int list_s;
+    unsigned long syscalls;                 // for the event loops, as theirs
+} listener_t;
+
+
+// I/O interface of the event loops: the conversation with
+// the client, session_step(), is the same for all of them
+typedef struct io_backend{
+    char *name;
+    void (*startup)(event_loop_t *loop);
+    void *(*run)(void *arg);
+    void (*flush)(session_t *s);            // sends the pending output, closing the session when it is over
+    void (*close)(session_t *s);
+} io_backend_t;
+
+
+// blocks the records are carved out of, one after the other: they are
+// never freed, as the accounts are never removed
+typedef struct arena{
+    char *block;
+    size_t used;
+    size_t size;
+} arena_t;
+
+
+// seats of a booking, in the index of the codes
+typedef struct booking{
+    char code[CODE_SIZE];
+    int *seats;
+    int count;
+    struct booking *next;                   // next booking in its bucket
+} booking_t;
+
+
+// a show in one of the halls: its seats, bookings and subscribers are
+// apart from the other shows', so are its locks and files
+typedef struct show{
+    int number;                             // from 0, the one of the legacy clients
+    int n;                                  // # rows
+    int m;                                  // # cols
+    stripe_t *stripes;                      // seats stripes, one per row
+    uint64_t *cinema;                       // seats, a bit each set when taken: every row starts on a new word
+    int row_words;                          // words of a row
+    int *row_free;                          // free seats of each row
+    int hall_free;                          // free seats of the hall
+    char *booking_addr;                     // booking array address
+    booking_t **booking_index;              // bookings by code, as many buckets as seats at least
+    size_t booking_index_size;
+    pthread_rwlock_t booking_index_lock;
+    unsigned long map_writes_started;       // seqlock of the seats map, with concurrent writers:
+    unsigned long map_writes_done;          // the map is stable when they are equal
+    unsigned long map_changes;              // version of the map, rolled back transactions don't count
+    change_t *change_log;                   // ring of the last CHANGE_LOG_SIZE flips, in version order
+    unsigned long change_log_count;         // flips logged since the startup
+    unsigned long change_log_floor;         // the flips of the versions after this one are all in the log
+    pthread_mutex_t change_log_mutex;
+    struct session *subscribers;            // sessions the seat changes are pushed to
+    char *push_frame;                       // delta of the last published version, serialized once for them all
+    size_t push_len;
+    size_t push_size;
+    unsigned long push_version;
+    pthread_mutex_t subscribers_mutex;
+    char seats_file[SHOW_FILE_NAME_SIZE];
+    char booking_file[SHOW_FILE_NAME_SIZE];
+} show_t;
+
+
+// booking of an account: the show tells which index has its seats
+typedef struct account_code{
+    char code[CODE_SIZE];
+    unsigned char show;                     // number of the show, below MAX_SHOWS
+} account_code_t;
 
 
 typedef struct person{
-    struct reservation *res_head;
-    struct person *next;
+    account_code_t *codes;                  // codes of the bookings, oldest first
+    int codes_count;
+    int codes_size;
+    struct person *next;                    // next account in its bucket
+    uint64_t hash;                          // of the email
     bool in_critical_section;
     char *email;
     char *nickname;
     char *psw;
-    int semfd;
+    pthread_mutex_t lock;                   // guards the reservations list, futex based: no syscall if uncontended
 } person_t;
 
 
+// part of the accounts index, holding the emails whose hash ends with its
+// number: the logins on it share its lock, the signups take it exclusively
+typedef struct account_shard{
+    pthread_rwlock_t lock;
+    person_t **buckets;
+    size_t size;                            // buckets, a power of two
+    size_t count;
+    arena_t arena;                          // of its accounts and their strings, under the write lock
+} account_shard_t;
+
+
 
 // method signatures
-void send1();
-void receive0();
-int user_access();
-int get_decision();
 void setup_events();
 void release_token();
-void cancel_events();
-void restore_events();
 void wait_for_token();
+void startup_stripes(show_t *show);
+void release_stripe(show_t *show, int row);
+void begin_map_write(show_t *show);
+void end_map_write(show_t *show, const int *seats, int count, bool taken);
+void publish_changes(show_t *show, const int *seats, int count, bool taken, unsigned long version);
+unsigned long map_version(show_t *show);
+void startup_change_log(show_t *show);
+void startup_shows();
+show_t *booking_show(const char *code);
+int compare_codes(const void *a, const void *b);
+change_t *changes_since(show_t *show, unsigned long since, unsigned long *version, int *count);
+unsigned long snapshot_map(show_t *show, char *dest);
 void print_accounts();
-char *get_random_code();
-int startup_semaphore();
-void sync_cinema_file();
+void get_random_code(char *code);
+void startup_codes();
+uint64_t permute_code(uint64_t x);
+void sync_cinema_file(show_t *show);
 void check_config_files();
 void sync_accounts_file();
-char *create_struct_file();
-char *create_booking_file();
-void sync_prenotazioni_file();
+uint64_t *create_struct_file(show_t *show);
+uint64_t *seat_word(show_t *show, int seat);
+uint64_t seat_bit(show_t *show, int seat);
+void count_seats(show_t *show, const int *seats_array, int bookings, int delta);
+void update_runs(show_t *show, const int *seats_array, int bookings);
+int longest_free_run(show_t *show, int row);
+char *create_booking_file(show_t *show);
+void sync_prenotazioni_file(show_t *show);
 void startup_seats_file(int fd);
-bool delete_booking(char *code);
+int delete_booking(char *code);
 bool remove_booking(char *code);
-person_t *create_accounts_file();
-void *child_func(void *arguments);
-void get_user_info(int access_type);
-char *retrieve_username(char *email);
-long get_port(int argc, char *argv[]);
-void init_person_list(person_t **head);
+void create_accounts_file();
+void end_session();
+void startup_pool();
+void *worker_func(void *arg);
+void child_func(t_args *args, event_loop_t *loop);
+t_args *take_connection(worker_t *self);
+void submit_connection(t_args *arguments);
+bool book_locked_seats(show_t *show, int *seats_array, int bookings);
+bool check_seats(show_t *show, int *seats_array, int bookings);
+int compare_seats(const void *a, const void *b);
+bool book_seats_optimistic(show_t *show, int *seats_array, int bookings);
+long get_options(int argc, char *argv[]);
+void print_io_stats();
+void startup_event_loops();
+void startup_listeners(long port);
+void startup_acceptors();
+void *accept_func(void *arg);
+void block_termination_signals(int how);
+void set_nodelay(int conn_s);
+bool session_step(session_t *s);
+bool session_frame_step(session_t *s);
+void session_frame_header(session_t *s, int type, uint32_t len);
+void session_cancel(session_t *s, char *code);
+void session_list_bookings(session_t *s);
+void session_list_shows(session_t *s);
+void session_select_show(session_t *s, uint32_t number);
+void session_subscribe(session_t *s, char *msg, uint32_t len);
+void session_unsubscribe(session_t *s);
+void remove_subscriber(session_t *s);
+void session_push(session_t *s);
+void session_free(session_t *s);
+void session_unlink(session_t *s);
+void expire_sessions(event_loop_t *loop, time_t now);
+bool session_input(session_t *s, size_t len);
+session_t *session_new(event_loop_t *loop, int conn_s);
+void epoll_startup(event_loop_t *loop);
+void *epoll_run(void *arg);
+void epoll_read(session_t *s);
+void epoll_flush(session_t *s);
+void uring_startup(event_loop_t *loop);
+void *uring_run(void *arg);
+void uring_read(session_t *s);
+void uring_flush(session_t *s);
+void uring_close(session_t *s);
+void uring_release(session_t *s);
+void uring_accept(event_loop_t *loop, listener_t *listener);
+void uring_tick(event_loop_t *loop);
+void uring_wake(event_loop_t *loop);
+void uring_add(event_loop_t *loop, int conn_s);
+void uring_submit(event_loop_t *loop, unsigned wait);
+struct io_uring_sqe *uring_get_sqe(event_loop_t *loop);
+void uring_complete(event_loop_t *loop, struct io_uring_cqe *cqe, time_t now);
+unsigned long session_send_map(session_t *s);
+unsigned long session_send_delta(session_t *s, unsigned long since);
+bool session_map_request(session_t *s, char *msg, uint32_t len);
+size_t encode_map(show_t *show, const char *snapshot, int encodings, char *encoding, char **encoded);
+void session_resume(session_t *s);
+void session_detach(session_t *s);
+bool session_lock_rows(session_t *s);
+void session_unlock_rows(session_t *s);
+void session_answer(session_t *s, bool booked);
+void session_queue_state(session_t *s, long position, long estimate);
+void wake_session(session_t *s);
+void run_wakeups(event_loop_t *loop);
+void startup_wakeups(event_loop_t *loop);
+void threads_wait(session_t *s);
+bool threads_readable(session_t *s);
+bool threads_idle(session_t *s);
+void threads_flush(session_t *s);
+void threads_close(session_t *s);
+void park_session(session_t *s);
+void *park_func(void *arg);
+void session_touch(session_t *s, time_t now);
+void session_book(session_t *s);
+void session_book_best(session_t *s);
+bool pick_best_seats(show_t *show, int count, bool adjacent, int first_row, int last_row, int *seats);
+int next_free_run(show_t *show, int row, int from, int *len);
+uint64_t row_word(show_t *show, int row, int w);
+void session_access(session_t *s, char *password);
+char *session_string(session_t *s, size_t size);
+char *session_message(session_t *s, size_t size);
+void add_session(event_loop_t *loop, int conn_s);
+long parse_long_option(char *arg, long min, long max);
+void session_write(session_t *s, const char *data, size_t len);
+void startup_accounts();
+uint64_t hash_email(const char *email);
+void grow_shard(account_shard_t *shard);
+person_t *find_account(account_shard_t *shard, uint64_t hash, const char *email);
 person_t *check_mail_exists(char *email);
-reservation_t *retrieve_booking (char *code);
-bool receive2(int **seats_array, int *bookings);
+int retrieve_booking(char *code);
 void startup_connection(int *list_s, long port);
-void init_reservation_list(reservation_t **head);
-void send3(int *seats_array, int bookings, char *code);
+void check_port_free(long port);
 person_t *check_account_exists(char *email, char *password);
-void *add_reservation_after(reservation_t *prev, char *code);
-void fill_bookings(int *seats_array, int bookings, char *code);
-void *add_person_after(person_t *prev, char *email, char *nickname, char *psw, reservation_t *reserv);
+void add_reservation(person_t *person, const char *code, int show);
+void *arena_alloc(arena_t *arena, size_t size, size_t align);
+char *arena_strdup(arena_t *arena, const char *str);
+void fill_bookings(show_t *show, int *seats_array, int bookings, char *code);
+void startup_booking_index(show_t *show);
+uint64_t hash_code(const char *code);
+uint64_t code_value(const char *code);
+booking_t *find_booking(show_t *show, const char *code);
+booking_t *unindex_booking(show_t *show, const char *code);
+person_t *add_account(const char *nickname, const char *email, const char *psw, int codes_size);
 
 
 
 
 // global variables
-int n;                            // # rows
-int m;                            // # cols
-int semfd;                        // semaphore file descriptor
-char *cinema;                     // cinema address
-char *booking_addr;               // booking array address
+show_t *shows;                    // the halls, each one with its own files and locks
+int shows_count = 1;
 pthread_t main_tid;               // main thread id (TID)
-person_t *accounts;
+int booking_engine = BOOKING_ENGINE_LOCKING;     // -e optimistic switches to compare-and-swap
+uint64_t code_keys[CODE_ROUNDS];       // drawn at the startup, they make the order of the codes unpredictable
+unsigned long codes_taken = 0;         // codes handed out to the threads, in blocks
+uint64_t *earlier_codes;               // of the earlier runs, sorted: only they can match a new code
+size_t earlier_codes_count = 0;
+int server_mode = SERVER_MODE_THREADS;
+int event_loops_count = 0;        // 0 means one event loop per core
+event_loop_t *event_loops;
+int listeners_count = 0;          // 0 means one listener per core
+int backlog = BACKLOG;
+listener_t *listeners;
+int workers_count = 0;            // 0 means WORKERS_PER_CORE workers per core
+worker_pool_t pool;
+event_loop_t parking;             // threads mode: the idle sessions, without a worker until their client sends something
+pthread_mutex_t parking_mutex = PTHREAD_MUTEX_INITIALIZER;
+int threads_subscribers = 0;      // threads mode: the subscribed sessions, each one holding a worker
+account_shard_t account_shards[ACCOUNT_SHARDS];
 
 // thread local variables
 __thread person_t *current_account = NULL;
 __thread int conn_s;              // conenction socket
 __thread bool connected = false;
-__thread bool in_signup_critical_section = false;
-__thread bool in_booking_critical_section = false;
+__thread bool in_worker = false;
+__thread unsigned long code_next = 0; // block of codes of the thread
+__thread unsigned long code_end = 0;
+__thread sigjmp_buf session_end;  // where a worker goes back when its session ends abruptly
 
 
 
@@ -104,24 +527,24 @@ __thread bool in_booking_critical_section = false;
             printf("\nError -> %s\n", strerror(errno));\
             fflush(stdout);\
             if(connected == true) { connected = false; close(conn_s); puts("closing connection error"); }\
-            if(in_booking_critical_section == true) { in_booking_critical_section = false; release_token(BOOKING_CRITICAL_SECTION_INDEX); }\
-            if(in_signup_critical_section == true) { in_signup_critical_section = false; release_token(SIGNUP_CRITICAL_SECTION_INDEX); }\
-            if(current_account->in_critical_section == true) { current_account->in_critical_section = false; release_token(DELETING_CRITICAL_SECTION_INDEX); }\
+            if(current_account != NULL && current_account->in_critical_section == true) { current_account->in_critical_section = false; release_token(DELETING_CRITICAL_SECTION_INDEX); }\
             exit(EXIT_FAILURE);\
 }\
 
 
 void event_handler(int signal){
-    void *status;
-    
     printf("\nsignal received: %d\n", signal);
     
     if(main_tid == pthread_self()){
-        // saving memory address containing bookings
-        sync_prenotazioni_file();
+        print_io_stats();
         
-        // saving memory address containing seats
-        sync_cinema_file();
+        for(int i=0; i<shows_count; i++){
+            // saving memory address containing bookings
+            sync_prenotazioni_file(&shows[i]);
+            
+            // saving memory address containing seats
+            sync_cinema_file(&shows[i]);
+        }
         
         // saving the structure containing accounts and their reservations
         sync_accounts_file();
@@ -138,20 +561,6 @@ void event_handler(int signal){
     }
     
     
-    // main does not enter in booking critical section, and only one thread at a 
-    // time does it, so the token can be released by only one of them
-    if(in_booking_critical_section == true){
-        in_booking_critical_section = false;
-        release_token(BOOKING_CRITICAL_SECTION_INDEX);
-    }
-    
-    // main does not enter in signup critical section, and only one thread at a 
-    // time does it, so the token can be released by only one of them
-    if(in_signup_critical_section == true){
-        in_signup_critical_section = false;
-        release_token(SIGNUP_CRITICAL_SECTION_INDEX);
-    }
-    
     // main does not enter in deleting critical section, and only one thread at a 
     // time does it, so the token can be released by only one of them
     if(current_account != NULL && current_account->in_critical_section == true){
@@ -161,29 +570,27 @@ void event_handler(int signal){
     
     
     if(main_tid == pthread_self()){
-        munmap((void *) cinema, n * m * sizeof(char));
-        munmap((void *) booking_addr, n * m * CODE_SIZE * sizeof(char));
+        for(int i=0; i<shows_count; i++)
+            munmap((void *) shows[i].booking_addr, shows[i].n * shows[i].m * CODE_SIZE * sizeof(char));
         
         exit(EXIT_FAILURE);
     }
-        
-    pthread_exit(&status);
+    
+    // a worker goes back to the pool
+    end_session();
 }
 
 
 
 
 int main(int argc, char *argv[]){
-    int         list_s;                       // listening socket
     long        port;                         // port used for the connection
-    struct      sockaddr_in connaddr;         // connection socket address
-    socklen_t   socket_in_size;               // size of client address
     
     
     main_tid = pthread_self();
     
-    // retreive the port number from cmd line 
-    port = get_port(argc, argv);
+    // retreive the port number and the options from cmd line 
+    port = get_options(argc, argv);
     
     // handling events
     setup_events();
@@ -191,47 +598,105 @@ int main(int argc, char *argv[]){
     // check about the compliance of files
     check_config_files();
     
-    cinema = create_struct_file();
-    booking_addr = create_booking_file();
-    accounts = create_accounts_file();
+    startup_shows();
+    create_accounts_file();
     
 #ifdef DEBUG
-    for(int i=0; i<n;i++){
-        for(int j=0;j<m;j++){
-            printf("%c", cinema[i * m + j]);
+    for(int k=0; k<shows_count; k++){
+        printf("show %d\n", k);
+        
+        for(int i=0; i<shows[k].n;i++){
+            for(int j=0;j<shows[k].m;j++){
+                printf("%c", *seat_word(&shows[k], i * shows[k].m + j) & seat_bit(&shows[k], i * shows[k].m + j) ? '1' : '0');
+            }
+            printf(" %d free\n", shows[k].row_free[i]);
         }
-        puts("");
+        
+        printf("cinema: %p\n", (void *) shows[k].cinema);
     }
-    
-    printf("cinema: %p\n", cinema);
     fflush(stdout);
 #endif
     
     // initializing communication components
-    startup_connection(&list_s, port);
+    startup_listeners(port);
     
-    semfd = startup_semaphore();
+    startup_codes();
     
-    // itialization of random num generator
-    srand(time(NULL));
+    if(server_mode == SERVER_MODE_THREADS)
+        startup_pool();
+    else
+        startup_event_loops();
     
-    // waiting for a connection
-    while(1){
-        char *code = get_random_code();
+    // io_uring loops accept the connections by themselves
+    if(server_mode != SERVER_MODE_URING)
+        startup_acceptors();
+    
+    // the main thread is left to the termination signals, to save the files
+    while(1)
+        pause();
+}
+
+
+
+
+void startup_acceptors(){
+    cpu_set_t cpus;
+    long cores;
+    
+    if((cores = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        cores = 1;
+    
+    block_termination_signals(SIG_BLOCK);
+    
+    for(int i=0; i<listeners_count; i++){
+        if(pthread_create(&listeners[i].tid, NULL, accept_func, &listeners[i]) != 0)
+            error("server: accept loop creation failed");
         
+        // an accept loop per core, the pinning is only a hint
+        CPU_ZERO(&cpus);
+        CPU_SET(i % cores, &cpus);
+        pthread_setaffinity_np(listeners[i].tid, sizeof(cpus), &cpus);
+    }
+    
+    block_termination_signals(SIG_UNBLOCK);
+}
+
+
+
+
+void *accept_func(void *arg){
+    listener_t *self = (listener_t *) arg;
+    struct      sockaddr_in connaddr;         // connection socket address
+    socklen_t   socket_in_size;               // size of client address
+    
+    // waiting for a connection
+    for(long accepted = 0; ; accepted++){
         socket_in_size = sizeof(struct sockaddr_in);
         
         redo224:
-        if ((conn_s = accept(list_s, (struct sockaddr *) &connaddr, &socket_in_size)) < 0){
+        if ((conn_s = accept(self->list_s, (struct sockaddr *) &connaddr, &socket_in_size)) < 0){
             if(errno != EINTR){
                 error("server: error during the accept\n");
             } else
                 goto redo224;
         }
         
-        // now the main process is connected
+        // now the accepting thread is connected
         connected = true;
         
+        // each response leaves with one send: nothing is gained waiting for more
+        set_nodelay(conn_s);
+        
+        
+        if(server_mode == SERVER_MODE_EPOLL){
+            // accept, setsockopt, two fcntl and epoll_ctl
+            self->syscalls += 5;
+            
+            // the connections are spread over the loops, which own them from now on
+            add_session(&event_loops[(self->index + accepted) % event_loops_count], conn_s);
+            connected = false;
+            continue;
+        }
         
     
         struct timeval recv_timeout;      
@@ -250,6 +715,9 @@ int main(int argc, char *argv[]){
         if (setsockopt(conn_s, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout)) < 0)
             error("setsockopt failed\n");
         
+        // accept and three setsockopt
+        self->syscalls += 4;
+        
         
         
         // printing the address of connection socket
@@ -257,282 +725,3161 @@ int main(int argc, char *argv[]){
         fflush(stdout);
         
         t_args *arguments = malloc(sizeof(*arguments));
-        arguments->code = code;
         arguments->conn_s = conn_s;
+        arguments->session = NULL;
         
-        
-        pthread_t tid;
-        pthread_create(&tid, NULL, child_func, (void *) arguments); // code and conn_s
+        // the accepting thread is no more connected, the socket belongs to the pool
+        connected = false;
+        submit_connection(arguments);
     }
+    
+    return NULL;
 }
 
 
 
 
-void *child_func(void *arguments){
-    void *status;
-    int bookings;
-    int *seats_array;
-    int decision;
-    int access_type;
-    t_args *args = (t_args *) arguments;
+void set_nodelay(int conn_s){
+    int on = 1;
+    
+    if(setsockopt(conn_s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+        error("setsockopt failed\n");
+}
+
+
+
+
+// runs the conversation with the client on the worker thread, which
+// blocks on each read and, while the booking is queued, on its wakeups;
+// a client slow to send is parked, and resumed by any worker
+void child_func(t_args *args, event_loop_t *loop){
+    session_t *s = args->session;
+    ssize_t res;
     
     conn_s = args->conn_s;
     connected = true;
+    current_account = NULL;
     
-    puts("");
-    fflush(stdout);
-    
-    if((access_type = user_access()) != WANT_TO_EXIT){
-        get_user_info(access_type);
-    
-        if((decision = get_decision()) == WANT_TO_BOOK){
-            send1();
-            
-            if(receive2(&seats_array, &bookings))
-                send3(seats_array, bookings, args->code);
-            
-            free(seats_array);
-        } else if(decision == WANT_TO_CANCEL){
-            receive0();                
+    if(s == NULL){
+        puts("");
+        fflush(stdout);
+        
+        s = session_new(loop, args->conn_s);
+        
+        if((s->in = malloc(SESSION_BUFFER_SIZE)) == NULL)
+            error("server: memory allocation failed");
+    } else
+        s->loop = loop;
+    
+    while(s->state != STATE_CLOSING){
+        if(s->state == STATE_LOCKING){
+            threads_wait(s);
+            continue;
         }
+        
+        // a subscribed session also waits for the pushes
+        if(s->subscribed){
+            if(!threads_readable(s))
+                continue;
+        } else if(threads_idle(s)){
+            // from now on the session may be resumed by another worker
+            connected = false;
+            park_session(s);
+            return;
+        }
+        
+        s->loop->syscalls++;
+        res = read(s->conn_s, s->in + s->in_start + s->in_len, SESSION_BUFFER_SIZE - s->in_start - s->in_len);
+        
+        if(res == -1 && errno == EINTR)
+            continue;
+        
+        // the client closed the connection, it is broken or SO_RCVTIMEO elapsed
+        if(res <= 0 || !session_input(s, res))
+            break;
+        
+        s->last_activity = time(NULL);
+        
+        threads_flush(s);
     }
     
-    
-    puts("server: closed connection");
-    fflush(stdout);
-
-    // closing connection socket description
-    if(close(args->conn_s) < 0)
-        error("server: closing connection failed.");
-    
-    free(args->code);
-    pthread_exit(&status);
+    // the session closes the socket
+    connected = false;
+    session_free(s);
 }
 
 
 
 
-int startup_semaphore(){
-    int fd;
+// blocks the worker until the queue of the booking moves, or
+// until it is time to tell the client it is still waiting
+void threads_wait(session_t *s){
+    struct pollfd pfd;
+    uint64_t value;
+    int res;
+    
+    pfd.fd = s->loop->wake_fd;
+    pfd.events = POLLIN;
     
-    if((fd = semget(IPC_PRIVATE, 2, IPC_CREAT | IPC_EXCL | 0666)) == -1)
-        error("server: semaphore creation failed");
+    // poll and read
+    s->loop->syscalls += 2;
+    if((res = poll(&pfd, 1, QUEUE_HEARTBEAT * 1000)) == -1 && errno != EINTR)
+        error("server: poll failed");
     
-    if(semctl(fd, 0, SETVAL, 1) == -1)
-        error("server: semaphore control operation failed");
+    if(res == 0){
+        s->sent_position = 0;
+        wake_session(s);
+    }
     
-    if(semctl(fd, 1, SETVAL, 1) == -1)
-        error("server: semaphore control operation failed");
+    if(read(s->loop->wake_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+        error("server: wakeup read failed");
     
-    return fd;
+    run_wakeups(s->loop);
 }
 
 
 
 
-int get_decision(){
-    char *buff;
+// blocks the worker of a subscribed session until the client sends
+// something, running the pushes meanwhile; true if there is input,
+// and the session is closed once SESSION_TIMEOUT elapses without any
+bool threads_readable(session_t *s){
+    struct pollfd pfds[2];
+    uint64_t value;
+    time_t left = s->last_activity + SESSION_TIMEOUT - time(NULL);
     int res;
     
-    if((buff = malloc(sizeof(char))) == NULL)
-        error("server: memory allocation failed");
+    pfds[0].fd = s->conn_s;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = s->loop->wake_fd;
+    pfds[1].events = POLLIN;
     
-    redo339:
-    // reading the decision from the client
-    res = read(conn_s, buff, sizeof(char));                                     // read -1
-
-    if(res == -1 && errno != EINTR){
-        error("read -1 failed");
-    }else if (errno == EINTR){
-        goto redo339;
-    }else if(res == 0)
-        raise(SIGINT);
+    s->loop->syscalls++;
+    if((res = poll(pfds, 2, left > 0 ? left * 1000 : 0)) == -1){
+        if(errno != EINTR)
+            error("server: poll failed");
+        return false;
+    }
     
+    if(res == 0){
+        printf("server: session timeout elapsed\n");
+        fflush(stdout);
+        threads_close(s);
+        return false;
+    }
     
-    if(*buff == '1'){
-        free(buff);
-        return WANT_TO_BOOK;
-    } else if(*buff == '2') {
-        free(buff);
-        return WANT_TO_CANCEL;
-    } else {
-        free(buff);
-        return WANT_TO_EXIT;
+    if(pfds[1].revents & POLLIN){
+        s->loop->syscalls++;
+        if(read(s->loop->wake_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+            error("server: wakeup read failed");
+        
+        run_wakeups(s->loop);
     }
+    
+    return pfds[0].revents != 0 && s->state != STATE_CLOSING;
 }
 
 
 
 
-void startup_connection(int *list_s, long port){
-    struct sockaddr_in listaddr;                // listening socket address
+// sends the whole output blocking; on errors the session is only
+// marked as closing, the worker frees it
+void threads_flush(session_t *s){
+    ssize_t res;
     
-    printf("server: listening from port %ld.\n", port);
-    fflush(stdout);
+    while(s->out_sent < s->out_len){
+        s->loop->syscalls++;
+        s->loop->sends++;
+        res = send(s->conn_s, s->out + s->out_sent, s->out_len - s->out_sent, MSG_NOSIGNAL);
+        
+        if(res == -1){
+            if(errno == EINTR)
+                continue;
+            
+            threads_close(s);
+            return;
+        }
+        
+        s->out_sent += res;
+    }
     
-    // creating the listening socket 
-    if ((*list_s = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-        error("server: error creating socket.\n");
+    s->out_sent = s->out_len = 0;
+}
+
+
+
+
+void threads_close(session_t *s){
+    s->state = STATE_CLOSING;
+    s->out_sent = s->out_len = 0;
+}
+
+
+
+
+// waits a little for the client's input, not at all when connections
+// are waiting for a worker; true if the session is better parked
+bool threads_idle(session_t *s){
+    struct pollfd pfd;
     
+    pfd.fd = s->conn_s;
+    pfd.events = POLLIN;
     
-    // resetting serveraddr structure   
-    // and fill it with relevant data
-    memset(&listaddr, 0, sizeof(listaddr));
-    listaddr.sin_family = AF_INET;
-    listaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    listaddr.sin_port = htons(port);
+    s->loop->syscalls++;
+    return poll(&pfd, 1, __atomic_load_n(&pool.pending, __ATOMIC_RELAXED) > 0 ? 0 : PARK_DELAY) == 0;
+}
+
+
+
+
+// gives the worker back to the pool: the parking thread submits
+// the session again once its client sends something
+void park_session(session_t *s){
+    struct epoll_event ev;
     
+    // epoll_ctl, twice the first time
+    s->loop->syscalls++;
     
-    // to avoid "Address already in use" error
-    int optval = 1;
-    setsockopt(*list_s, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+    // the wakeups of a queued booking link it in the worker's list, where it is the only one
+    session_unlink(s);
     
+    pthread_mutex_lock(&parking_mutex);
+    s->loop = &parking;
+    session_touch(s, time(NULL));
+    pthread_mutex_unlock(&parking_mutex);
     
-    // binding listening socket
-    if (bind(*list_s, (struct sockaddr *) &listaddr, sizeof(listaddr)) < 0)
-        error("server: error during bind.\n");
-        
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = s;
     
-    // make the server listening
-    if (listen(*list_s, BACKLOG) < 0)
-        error("server: error during listen.\n");
+    // a resumed session stays in the set, disabled until the next park
+    if(epoll_ctl(parking.epfd, EPOLL_CTL_MOD, s->conn_s, &ev) == -1
+            && (errno != ENOENT || epoll_ctl(parking.epfd, EPOLL_CTL_ADD, s->conn_s, &ev) == -1))
+        error("server: epoll_ctl failed");
 }
 
 
 
 
-void check_config_files(){
-    // if one of this files does not exists, then all the existing ones must be deleted
-    if(access(SEATS_FILE_NAME, F_OK) || access(BOOKING_FILE_NAME, F_OK) || access(ACCOUNTS_FILE_NAME, F_OK)){
-        if(!access(SEATS_FILE_NAME, F_OK))
-            unlink(BOOKING_FILE_NAME);
-        
+// resubmits to the pool the parked sessions with some input, and closes
+// the ones inactive for more than SESSION_TIMEOUT
+void *park_func(void *arg){
+    struct epoll_event events[MAX_EVENTS];
+    session_t *s;
+    t_args *arguments;
+    time_t now;
+    int nfds;
     
-        if(!access(BOOKING_FILE_NAME, F_OK))
-            unlink(BOOKING_FILE_NAME);
+    (void) arg;
+    
+    while(1){
+        parking.syscalls++;
+        if((nfds = epoll_wait(parking.epfd, events, MAX_EVENTS, 1000)) == -1){
+            if(errno == EINTR)
+                continue;
+            error("server: epoll wait failed");
+        }
         
+        for(int i=0; i<nfds; i++){
+            s = (session_t *) events[i].data.ptr;
+            
+            pthread_mutex_lock(&parking_mutex);
+            session_unlink(s);
+            pthread_mutex_unlock(&parking_mutex);
+            
+            if((arguments = malloc(sizeof(*arguments))) == NULL)
+                error("server: memory allocation failed");
+            arguments->conn_s = s->conn_s;
+            arguments->session = s;
+            
+            submit_connection(arguments);
+        }
         
-        if(!access(ACCOUNTS_FILE_NAME, F_OK))
-            unlink(ACCOUNTS_FILE_NAME);
+        now = time(NULL);
         
+        // closing the descriptor also removes it from the epoll set
+        pthread_mutex_lock(&parking_mutex);
+        while((s = parking.oldest) != NULL && now - s->last_activity > SESSION_TIMEOUT){
+            printf("server: session timeout elapsed\n");
+            fflush(stdout);
+            session_free(s);
+        }
+        pthread_mutex_unlock(&parking_mutex);
     }
+    
+    return NULL;
 }
 
 
 
 
-char *create_struct_file(){
-    int fd;                                     // file descriptor of "cinema_struct" file
-    int file_len;                               // the len of file
-    char *buff;                                 // temporary buffer
-    char *addr;                                 // address to the shared mem. that contains the seats infos
-    ssize_t memlen;                             // the length of the shared mem.
+io_backend_t epoll_backend = { "epoll", epoll_startup, epoll_run, epoll_flush, session_free };
+io_backend_t uring_backend = { "io_uring", uring_startup, uring_run, uring_flush, uring_close };
+io_backend_t threads_backend = { "threads", NULL, NULL, threads_flush, threads_close };
+io_backend_t *backend;
+
+
+
+
+// ends the session of the current thread: a worker goes back
+// to the pool, any other thread exits
+void end_session(){
+    void *status;
     
+    if(in_worker)
+        siglongjmp(session_end, 1);
     
+    pthread_exit(&status);
+}
+
+
+
+
+// creates the workers once, with small stacks
+void startup_pool(){
+    pthread_attr_t attr;
     
-    // exclusive creation of file
-    if((fd = open(SEATS_FILE_NAME, O_CREAT|O_EXCL|O_RDWR, 0666)) == -1){        
-        // retry the file opening without exclusive creation
-        if((fd = open(SEATS_FILE_NAME, O_RDWR, 0666)) == -1)
-            error("server: seats file opening failed.");
-        
-    } else {
-        // if the just is just created we need
-        // to fill it with some information
-        startup_seats_file(fd);
+    if(workers_count == 0){
+        if((workers_count = sysconf(_SC_NPROCESSORS_ONLN) * WORKERS_PER_CORE) < WORKERS_PER_CORE)
+            workers_count = WORKERS_PER_CORE;
+        else if(workers_count > MAX_WORKERS)
+            workers_count = MAX_WORKERS;
     }
     
+    pool.size = workers_count;
     
-    // retrieving the length of file
-    file_len = lseek(fd, 0, SEEK_END);
-    lseek(fd, 0, SEEK_SET);
+    if((pool.workers = calloc(pool.size, sizeof(worker_t))) == NULL)
+        error("server: memory allocation failed");
     
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.space_available, NULL);
     
-    if((buff = malloc(file_len)) == NULL)
-        error("server: dynamic memory allocation failed.");
-        
+    if((parking.epfd = epoll_create1(0)) == -1)
+        error("server: epoll creation failed");
     
-    // reading the "cinema_struct" file
-    if(read(fd, buff, file_len) == -1)
-        error("server: error during file reading.\n");
+    backend = &threads_backend;
     
+    pthread_attr_init(&attr);
+    if(pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE) != 0)
+        error("server: worker stack size not valid");
     
-    // reading file infos
-    n = atoi(strtok(buff, ";"));
-    m = atoi(strtok(NULL, ";"));
+    block_termination_signals(SIG_BLOCK);
     
-    if(!n || !m)
-        error("server: integer conversion failed.");
+    for(int i=0; i<pool.size; i++){
+        pthread_mutex_init(&pool.workers[i].mutex, NULL);
+        pthread_cond_init(&pool.workers[i].work_available, NULL);
+        
+        if(pthread_create(&pool.workers[i].tid, &attr, worker_func, &pool.workers[i]) != 0)
+            error("server: worker creation failed");
+    }
     
-    memlen = n * m * sizeof(char);
+    if(pthread_create(&parking.tid, &attr, park_func, NULL) != 0)
+        error("server: parking thread creation failed");
     
-    if((addr = (char *) mmap(NULL, memlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, 0, 0)) == MAP_FAILED)
-        error("server: memory mapping failed.");
+    block_termination_signals(SIG_UNBLOCK);
     
+    pthread_attr_destroy(&attr);
     
-#ifdef DEBUG
-    printf("%d, %d\n", n, m);
+    printf("server: %d workers started\n", pool.size);
     fflush(stdout);
-    printf("addr: %p\n", addr);
-    fflush(stdout);
-#endif
-    
-    // copy the file inside the memory pointed by "addr"
-    for(int i=0; i<n; i++){
-        strncpy(addr, strtok(NULL, ";"), m);
-        addr += m * sizeof(char);
-    }
-    
-    free(buff);
-    close(fd);
-    
-    return addr - memlen;
 }
 
 
 
 
-char *create_booking_file(){
-    int fd;
-    int counter = 0;
-    char *addr;
-    size_t size = CODE_SIZE + 2;
-    char *buff; // +2 includes '\n' and '\0'
-    FILE *file;
-    
-    
-    if((buff = malloc(sizeof(char) * size)) == NULL)
-        error("server: memory allocation failed");
-    
+// queues the connection on the deque of an idle worker, which is woken up, or
+// else on the first one with a free slot, waiting while all of them are full
+void submit_connection(t_args *arguments){
+    worker_t *worker;
+    int pending = __atomic_add_fetch(&pool.pending, 1, __ATOMIC_SEQ_CST);
+    unsigned first = __atomic_fetch_add(&pool.next, 1, __ATOMIC_RELAXED) % pool.size;
+    bool woken = false;
     
-    // exclusive creation of file
-    if((fd = open(BOOKING_FILE_NAME, O_CREAT|O_EXCL|O_RDWR, 0666)) == -1){
-        // retry the file opening without exclusive creation
-        if((fd = open(BOOKING_FILE_NAME, O_RDWR, 0666)) == -1)
-            error("server: seats file opening failed.");
+    if(__atomic_load_n(&pool.busy, __ATOMIC_RELAXED) + pending > pool.size && !__atomic_exchange_n(&pool.saturated, true, __ATOMIC_RELAXED)){
+        printf("server: worker pool saturated, %d connections waiting\n", pending);
+        fflush(stdout);
     }
     
-    // creating the shared memory mapping
-    if((addr = (char *) mmap(NULL, n * m * CODE_SIZE * sizeof(char), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, 0, 0)) == MAP_FAILED)
-        error("server: memory mapping failed.");
-    
-    
-    if ((file = fdopen(fd, "w+")) == NULL)
-        error("server: error while conversion from file descriptor to FILE *");
+    // the pending counter reserves the slot, so a deque with a free one exists
+    if(pending > pool.size * WORKER_QUEUE_SIZE){
+        pthread_mutex_lock(&pool.mutex);
+        __atomic_add_fetch(&pool.waiting, 1, __ATOMIC_SEQ_CST);
+        while(__atomic_load_n(&pool.pending, __ATOMIC_SEQ_CST) > pool.size * WORKER_QUEUE_SIZE)
+            pthread_cond_wait(&pool.space_available, &pool.mutex);
+        __atomic_sub_fetch(&pool.waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool.mutex);
+    }
     
-    while(getline(&buff, &size, file) > 0){
-        if(buff[0] != '\n'){
-            memcpy(addr + CODE_SIZE * counter, buff, CODE_SIZE);
+    // the idle workers are tried first, then any deque with a free slot
+    for(int i=0; arguments != NULL; i++){
+        worker = &pool.workers[(first + i) % pool.size];
+        
+        if(i < pool.size && !__atomic_load_n(&worker->idle, __ATOMIC_SEQ_CST))
+            continue;
+        
+        pthread_mutex_lock(&worker->mutex);
+        if(worker->count < WORKER_QUEUE_SIZE){
+            worker->deque[(worker->first + worker->count) % WORKER_QUEUE_SIZE] = arguments;
+            worker->count++;
+            arguments = NULL;
+            
+            if(worker->idle){
+                __atomic_store_n(&worker->idle, false, __ATOMIC_SEQ_CST);
+                pthread_cond_signal(&worker->work_available);
+                woken = true;
+            }
         }
-        counter++;
+        pthread_mutex_unlock(&worker->mutex);
     }
     
-    
-    close(fd);
-    fclose(file);
-    free(buff);
-    
+    // queued behind a busy worker: an idle one, if any, steals it
+    for(int i=0; i<pool.size && !woken; i++){
+        worker = &pool.workers[(first + i) % pool.size];
+        
+        if(!__atomic_load_n(&worker->idle, __ATOMIC_SEQ_CST))
+            continue;
+        
+        pthread_mutex_lock(&worker->mutex);
+        if(worker->idle){
+            __atomic_store_n(&worker->idle, false, __ATOMIC_SEQ_CST);
+            pthread_cond_signal(&worker->work_available);
+            woken = true;
+        }
+        pthread_mutex_unlock(&worker->mutex);
+    }
+}
+
+
+
+
+// takes the oldest connection of its own deque or, when it is empty, steals
+// the newest one of another worker, sleeping while there are none
+t_args *take_connection(worker_t *self){
+    t_args *arguments;
+    worker_t *victim;
+    int index = self - pool.workers;
+    
+    while(1){
+        arguments = NULL;
+        
+        pthread_mutex_lock(&self->mutex);
+        while(self->idle)
+            pthread_cond_wait(&self->work_available, &self->mutex);
+        
+        if(self->count > 0){
+            arguments = self->deque[self->first];
+            self->first = (self->first + 1) % WORKER_QUEUE_SIZE;
+            self->count--;
+        }
+        pthread_mutex_unlock(&self->mutex);
+        
+        for(int i=1; i<pool.size && arguments == NULL; i++){
+            victim = &pool.workers[(index + i) % pool.size];
+            
+            if(__atomic_load_n(&victim->count, __ATOMIC_RELAXED) == 0)
+                continue;
+            
+            pthread_mutex_lock(&victim->mutex);
+            if(victim->count > 0){
+                victim->count--;
+                arguments = victim->deque[(victim->first + victim->count) % WORKER_QUEUE_SIZE];
+            }
+            pthread_mutex_unlock(&victim->mutex);
+        }
+        
+        if(arguments != NULL)
+            break;
+        
+        // idle first, then the counter: a submission either sees the flag or is seen here
+        pthread_mutex_lock(&self->mutex);
+        __atomic_store_n(&self->idle, true, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&self->mutex);
+        
+        if(__atomic_load_n(&pool.pending, __ATOMIC_SEQ_CST) > 0){
+            // a connection on its way to a deque
+            pthread_mutex_lock(&self->mutex);
+            __atomic_store_n(&self->idle, false, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&self->mutex);
+            sched_yield();
+        }
+    }
+    
+    __atomic_add_fetch(&pool.busy, 1, __ATOMIC_RELAXED);
+    
+    // the slot is free again, for the accept loops waiting on a full pool
+    __atomic_sub_fetch(&pool.pending, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&pool.waiting, __ATOMIC_SEQ_CST) > 0){
+        pthread_mutex_lock(&pool.mutex);
+        pthread_cond_broadcast(&pool.space_available);
+        pthread_mutex_unlock(&pool.mutex);
+    }
+    
+    return arguments;
+}
+
+
+
+
+void *worker_func(void *arg){
+    worker_t *self = (worker_t *) arg;
+    t_args *volatile arguments;
+    event_loop_t loop;                      // only for the wakeups of its sessions
+    
+    in_worker = true;
+    
+    memset(&loop, 0, sizeof(loop));
+    startup_wakeups(&loop);
+    self->loop = &loop;
+    
+    while(1){
+        arguments = take_connection(self);
+        
+        // on session_end the connection has already been closed
+        if(sigsetjmp(session_end, 1) == 0)
+            child_func(arguments, &loop);
+        
+        free(arguments);
+        
+        if(__atomic_sub_fetch(&pool.busy, 1, __ATOMIC_RELAXED) + __atomic_load_n(&pool.pending, __ATOMIC_RELAXED) < pool.size
+                && __atomic_exchange_n(&pool.saturated, false, __ATOMIC_RELAXED)){
+            puts("server: worker pool no longer saturated");
+            fflush(stdout);
+        }
+    }
+    
+    return NULL;
+}
+
+
+
+
+
+void startup_event_loops(){
+    backend = server_mode == SERVER_MODE_URING ? &uring_backend : &epoll_backend;
+    
+    if(event_loops_count == 0){
+        if((event_loops_count = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+            event_loops_count = 1;
+        else if(event_loops_count > MAX_EVENT_LOOPS)
+            event_loops_count = MAX_EVENT_LOOPS;
+    }
+    
+    if((event_loops = calloc(event_loops_count, sizeof(event_loop_t))) == NULL)
+        error("server: memory allocation failed");
+    
+    block_termination_signals(SIG_BLOCK);
+    
+    for(int i=0; i<event_loops_count; i++){
+        backend->startup(&event_loops[i]);
+        
+        if(pthread_create(&event_loops[i].tid, NULL, backend->run, &event_loops[i]) != 0)
+            error("server: event loop creation failed");
+    }
+    
+    block_termination_signals(SIG_UNBLOCK);
+    
+    printf("server: %d %s event loops started\n", event_loops_count, backend->name);
+    fflush(stdout);
+}
+
+
+
+
+
+// the threads created in between inherit the mask: termination signals are
+// left to the main thread, which is the only one that can save the files
+void block_termination_signals(int how){
+    sigset_t set;
+    
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGQUIT);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(how, &set, NULL);
+}
+
+
+
+
+// to compare the backends: the counters are read without synchronization
+void print_io_stats(){
+    unsigned long syscalls = 0;
+    unsigned long bookings = 0;
+    unsigned long writes = 0;
+    unsigned long sends = 0;
+    event_loop_t *loop;
+    
+    for(int i=0; i<listeners_count; i++)
+        syscalls += listeners[i].syscalls;
+    
+    // the workers have a loop each, only for their sessions
+    for(int i=0; i<(server_mode == SERVER_MODE_THREADS ? pool.size : event_loops_count); i++){
+        if((loop = server_mode == SERVER_MODE_THREADS ? pool.workers[i].loop : &event_loops[i]) == NULL)
+            continue;
+        
+        syscalls += loop->syscalls;
+        bookings += loop->bookings;
+        writes += loop->writes;
+        sends += loop->sends;
+    }
+    
+    printf("server: %s backend, %lu I/O syscalls for %lu bookings", backend->name, syscalls, bookings);
+    if(bookings > 0)
+        printf(" (%.1f per booking)", (double) syscalls / bookings);
+    printf(", %lu writes gathered in %lu sends", writes, sends);
+    if(bookings > 0)
+        printf(" (%.1f per booking)", (double) sends / bookings);
+    puts("");
+}
+
+
+
+
+session_t *session_new(event_loop_t *loop, int conn_s){
+    session_t *s;
+    
+    if((s = calloc(1, sizeof(session_t))) == NULL)
+        error("server: memory allocation failed");
+    
+    s->conn_s = conn_s;
+    s->state = STATE_ACCESS;
+    s->protocol = PROTOCOL_LEGACY;
+    s->loop = loop;
+    s->slot = -1;
+    s->show = &shows[0];                // the legacy protocol only knows the first show
+    s->last_activity = time(NULL);
+    
+    return s;
+}
+
+
+
+
+// moves the session at the end of the loop's list
+void session_touch(session_t *s, time_t now){
+    event_loop_t *loop = s->loop;
+    
+    s->last_activity = now;
+    
+    if(loop->newest == s)
+        return;
+    
+    // unlinking, when already linked
+    if(s->prev != NULL)
+        s->prev->next = s->next;
+    else if(loop->oldest == s)
+        loop->oldest = s->next;
+    if(s->next != NULL)
+        s->next->prev = s->prev;
+    
+    s->prev = loop->newest;
+    s->next = NULL;
+    if(loop->newest != NULL)
+        loop->newest->next = s;
+    loop->newest = s;
+    if(loop->oldest == NULL)
+        loop->oldest = s;
+}
+
+
+
+
+void session_unlink(session_t *s){
+    event_loop_t *loop = s->loop;
+    
+    if(s->prev != NULL)
+        s->prev->next = s->next;
+    else
+        loop->oldest = s->next;
+    if(s->next != NULL)
+        s->next->prev = s->prev;
+    else
+        loop->newest = s->prev;
+    
+    s->prev = s->next = NULL;
+}
+
+
+
+
+// closes the sessions inactive for more than SESSION_TIMEOUT, which
+// are at the head of the loop's list
+void expire_sessions(event_loop_t *loop, time_t now){
+    session_t *s;
+    
+    while((s = loop->oldest) != NULL){
+        // the queued sessions don't expire, the client is told they are still waiting
+        if(s->state == STATE_LOCKING && now - s->last_activity > QUEUE_HEARTBEAT){
+            session_touch(s, now);
+            s->sent_position = 0;
+            wake_session(s);
+        } else if(now - s->last_activity > SESSION_TIMEOUT){
+            printf("server: session timeout elapsed\n");
+            fflush(stdout);
+            backend->close(s);
+        } else
+            break;
+    }
+}
+
+
+
+
+void session_free(session_t *s){
+    session_detach(s);
+    session_unlink(s);
+    
+    puts("server: closed connection");
+    fflush(stdout);
+    
+    // closing the descriptor also removes it from the epoll set
+    s->loop->syscalls++;
+    if(close(s->conn_s) < 0)
+        puts("server: closing connection failed.");
+    
+    if(s->slot == -1)
+        free(s->in);
+    free(s->seats_array);
+    free(s->out);
+    free(s->sending);
+    free(s);
+}
+
+
+
+
+// consumes the len bytes just received in the input buffer running the
+// conversation as far as possible; false if the session must be closed
+bool session_input(session_t *s, size_t len){
+    s->in_len += len;
+    
+    while(s->state != STATE_CLOSING && session_step(s));
+    
+    if(s->state == STATE_CLOSING){
+        s->in_start = s->in_len = 0;
+        return true;
+    }
+    
+    // a message can't be longer than the buffer
+    if(s->in_start + s->in_len == SESSION_BUFFER_SIZE){
+        if(s->in_start == 0){
+            puts("server: message too long");
+            return false;
+        }
+        
+        memmove(s->in, s->in + s->in_start, s->in_len);
+        s->in_start = 0;
+    }
+    
+    return true;
+}
+
+
+
+
+void epoll_startup(event_loop_t *loop){
+    struct epoll_event event;
+    
+    if((loop->epfd = epoll_create1(0)) == -1)
+        error("server: epoll creation failed");
+    
+    startup_wakeups(loop);
+    
+    // the only event without a session
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake_fd, &event) == -1)
+        error("server: epoll control operation failed");
+}
+
+
+
+
+// hands a just accepted connection to an epoll loop
+void add_session(event_loop_t *loop, int conn_s){
+    session_t *s;
+    struct epoll_event event;
+    
+    s = session_new(loop, conn_s);
+    
+    if((s->in = malloc(SESSION_BUFFER_SIZE)) == NULL)
+        error("server: memory allocation failed");
+    
+    if(fcntl(conn_s, F_SETFL, fcntl(conn_s, F_GETFL) | O_NONBLOCK) == -1)
+        error("server: fcntl failed");
+    
+    event.events = EPOLLIN;
+    event.data.ptr = s;
+    
+    // the session is linked to the loop's list by the loop itself, through
+    // a wakeup, so that a client that never writes is expired as well; the
+    // wakeup comes first, once added to the set only the loop touches it
+    wake_session(s);
+    
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn_s, &event) == -1)
+        error("server: epoll control operation failed");
+}
+
+
+
+
+void *epoll_run(void *arg){
+    event_loop_t *loop = (event_loop_t *) arg;
+    struct epoll_event events[MAX_EVENTS];
+    session_t *s;
+    uint64_t value;
+    time_t now;
+    int nfds;
+    
+    while(1){
+        loop->syscalls++;
+        if((nfds = epoll_wait(loop->epfd, events, MAX_EVENTS, 1000)) == -1){
+            if(errno == EINTR)
+                continue;
+            error("server: epoll wait failed");
+        }
+        
+        now = time(NULL);
+        
+        for(int i=0; i<nfds; i++){
+            // some sessions have been woken up by other threads
+            if((s = (session_t *) events[i].data.ptr) == NULL){
+                loop->syscalls++;
+                if(read(loop->wake_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+                    error("server: wakeup read failed");
+                
+                run_wakeups(loop);
+                continue;
+            }
+            
+            session_touch(s, now);
+            
+            if(events[i].events & EPOLLIN)
+                epoll_read(s);
+            else if(events[i].events & (EPOLLERR | EPOLLHUP))
+                session_free(s);
+            else if(events[i].events & EPOLLOUT)
+                epoll_flush(s);
+        }
+        
+        expire_sessions(loop, now);
+    }
+    
+    return NULL;
+}
+
+
+
+
+// reads what is available and runs the conversation as far as possible
+void epoll_read(session_t *s){
+    ssize_t res;
+    
+    s->loop->syscalls++;
+    res = read(s->conn_s, s->in + s->in_start + s->in_len, SESSION_BUFFER_SIZE - s->in_start - s->in_len);
+    
+    if(res == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    
+    // the client closed the connection or it is broken
+    if(res <= 0 || !session_input(s, res)){
+        session_free(s);
+        return;
+    }
+    
+    epoll_flush(s);
+}
+
+
+
+
+// returns the next message of exactly size bytes, NULL until it is complete
+char *session_message(session_t *s, size_t size){
+    char *msg;
+    
+    if(s->in_len < size)
+        return NULL;
+    
+    msg = s->in + s->in_start;
+    s->in_start += size;
+    s->in_len -= size;
+    
+    if(s->in_len == 0)
+        s->in_start = 0;
+    
+    return msg;
+}
+
+
+
+
+// returns the next '\0' terminated message, at most size bytes long; NULL
+// until it is complete, and an empty string if it is too long
+char *session_string(session_t *s, size_t size){
+    char *msg = s->in + s->in_start;
+    char *end;
+    
+    if((end = memchr(msg, '\0', s->in_len < size ? s->in_len : size)) == NULL){
+        if(s->in_len >= size)
+            return "";
+        return NULL;
+    }
+    
+    return session_message(s, end - msg + 1);
+}
+
+
+
+
+// runs the step of the conversation waiting for the next message,
+// returns false if the message is not complete yet
+bool session_step(session_t *s){
+    show_t *show = s->show;
+    char *msg;
+    char password[MAX_INPUT_SIZE];
+    char code[CODE_SIZE + 1];
+    char version[VERSION_SIZE + 1];
+    char number[11];                        // an integer lenght is 10 at most, plus the '\0'
+    size_t seat_size = (log10(show->n * show->m) + 2) * sizeof(char);
+    
+    if(s->protocol == PROTOCOL_V2)
+        return session_frame_step(s);
+    
+    switch(s->state){
+        case STATE_ACCESS:
+            if((msg = session_message(s, sizeof(char))) == NULL)                          // read -2
+                return false;
+            
+            if(*msg == PROTOCOL_MAGIC){
+                s->protocol = PROTOCOL_V2;
+                s->state = STATE_HELLO;
+                return true;
+            } else if(*msg == '1')
+                s->access_type = WANT_TO_SIGN_IN;
+            else if(*msg == '2')
+                s->access_type = WANT_TO_SIGN_UP;
+            else {
+                s->state = STATE_CLOSING;
+                return true;
+            }
+            
+            s->state = STATE_EMAIL;
+            return true;
+            
+        case STATE_EMAIL:
+            if((msg = session_message(s, MAX_INPUT_SIZE * sizeof(char))) == NULL)         // read -2.1.1
+                return false;
+            
+            memcpy(s->email, msg, MAX_INPUT_SIZE);
+            s->email[MAX_INPUT_SIZE - 1] = '\0';
+            
+            s->state = s->access_type == WANT_TO_SIGN_UP ? STATE_USERNAME : STATE_PASSWORD;
+            return true;
+            
+        case STATE_USERNAME:
+            if((msg = session_message(s, MAX_INPUT_SIZE * sizeof(char))) == NULL)         // read -2.1.2
+                return false;
+            
+            memcpy(s->username, msg, MAX_INPUT_SIZE);
+            s->username[MAX_INPUT_SIZE - 1] = '\0';
+            
+            s->state = STATE_PASSWORD;
+            return true;
+            
+        case STATE_PASSWORD:
+            if((msg = session_message(s, MAX_INPUT_SIZE * sizeof(char))) == NULL)         // read -2.1.3
+                return false;
+            
+            memcpy(password, msg, MAX_INPUT_SIZE);
+            password[MAX_INPUT_SIZE - 1] = '\0';
+            
+            session_access(s, password);
+            return true;
+            
+        case STATE_DECISION:
+            if((msg = session_message(s, sizeof(char))) == NULL)                          // read -1
+                return false;
+            
+            if(*msg == '1'){
+                snprintf(number, sizeof(number), "%d", show->n);
+                session_write(s, number, sizeof(number) - 1);                             // write 1
+                snprintf(number, sizeof(number), "%d", show->m);
+                session_write(s, number, sizeof(number) - 1);                             // write 2
+                
+                session_send_map(s);
+                
+                if(s->state != STATE_CLOSING)
+                    s->state = STATE_BOOKINGS;
+            } else if(*msg == '2')
+                s->state = STATE_CODE;
+            else
+                s->state = STATE_CLOSING;
+            return true;
+            
+        case STATE_CODE:
+            if((msg = session_message(s, CODE_SIZE * sizeof(char))) == NULL)              // read 0.1
+                return false;
+            
+            memcpy(code, msg, CODE_SIZE);
+            code[CODE_SIZE] = '\0';
+            
+            session_cancel(s, code);
+            return true;
+            
+        case STATE_BOOKINGS:
+            // the client doesn't want to book anymore: its "0" has no '\0'
+            if(s->in_len > 0 && s->in[s->in_start] == '0'){
+                s->state = STATE_CLOSING;
+                return true;
+            }
+            
+            if((msg = session_string(s, seat_size)) == NULL)                              // read 4
+                return false;
+            
+            if((s->bookings = atoi(msg)) <= 0 || s->bookings > show->n * show->m){
+                puts("server: wrong number of seats.");
+                s->state = STATE_CLOSING;
+                return true;
+            }
+            
+            if((s->seats_array = malloc(s->bookings * sizeof(int))) == NULL)
+                error("server: memory allocation failed.");
+            
+            s->received = 0;
+            s->state = STATE_VERSION;
+            return true;
+            
+        case STATE_VERSION:
+            if((msg = session_message(s, VERSION_SIZE)) == NULL)                          // read 4.1
+                return false;
+            
+            memcpy(version, msg, VERSION_SIZE);
+            version[VERSION_SIZE] = '\0';
+            s->version = strtoul(version, NULL, 10);
+            
+            s->state = STATE_SEAT;
+            return true;
+            
+        case STATE_SEAT:
+            if((msg = session_string(s, seat_size)) == NULL)                              // read 5
+                return false;
+            
+            // the whole choice is checked by session_book()
+            s->seats_array[s->received++] = atoi(msg);
+            
+            if(s->received == s->bookings)
+                session_book(s);
+            return true;
+            
+        case STATE_RETRY:
+            if((msg = session_message(s, sizeof(char))) == NULL)                          // read 7
+                return false;
+            
+            if(*msg == 'y' || *msg == 'Y'){
+                session_send_map(s);
+                
+                if(s->state != STATE_CLOSING)
+                    s->state = STATE_BOOKINGS;
+            } else {
+                puts("Input canceled");
+                s->state = STATE_CLOSING;
+            }
+            return true;
+            
+        default:
+            return false;
+    }
+}
+
+
+
+
+
+// runs the step of a v2 conversation on the next frame, returns false
+// if the frame is not complete yet
+bool session_frame_step(session_t *s){
+    show_t *show = s->show;
+    char *msg;
+    char *end;
+    const char *field;
+    char password[MAX_INPUT_SIZE];
+    char code[CODE_SIZE + 1];
+    char hello[2];
+    uint32_t len;
+    int type;
+    
+    // a queued booking takes no messages until it is resumed
+    if(s->state == STATE_LOCKING || s->in_len < FRAME_HEADER_SIZE)
+        return false;
+    
+    type = (unsigned char) s->in[s->in_start];
+    
+    if((len = get_u32(s->in + s->in_start + 1)) > MAX_FRAME_SIZE){
+        puts("server: message too long");
+        s->state = STATE_CLOSING;
+        return true;
+    }
+    
+    if((msg = session_message(s, FRAME_HEADER_SIZE + len)) == NULL)
+        return false;
+    
+    msg += FRAME_HEADER_SIZE;
+    end = msg + len;
+    
+    if(type == FRAME_BYE){
+        s->state = STATE_CLOSING;
+        return true;
+    }
+    
+    // the input alone has kept the session alive
+    if(type == FRAME_PING && len == 0)
+        return true;
+    
+    switch(s->state){
+        case STATE_HELLO:
+            // only v2 is spoken, but newer clients can step down to it
+            if(type != FRAME_HELLO || len < sizeof(char) || *msg < PROTOCOL_V2)
+                break;
+            
+            // the map encodings both sides know
+            s->map_encodings = len > 1 ? msg[1] & (MAP_ENCODING_BITMAP | MAP_ENCODING_RLE) : 0;
+            
+            hello[0] = PROTOCOL_V2;
+            hello[1] = s->map_encodings;
+            session_frame_header(s, FRAME_HELLO, sizeof(hello));
+            session_write(s, hello, sizeof(hello));
+            
+            s->state = STATE_ACCESS;
+            return true;
+            
+        case STATE_ACCESS:
+            if(type != FRAME_SIGN_IN && type != FRAME_SIGN_UP)
+                break;
+            
+            s->access_type = type == FRAME_SIGN_UP ? WANT_TO_SIGN_UP : WANT_TO_SIGN_IN;
+            
+            if((field = get_str(msg, end, s->email)) == NULL ||
+                (type == FRAME_SIGN_UP && (field = get_str(field, end, s->username)) == NULL) ||
+                (field = get_str(field, end, password)) == NULL || field != end)
+                break;
+            
+            session_access(s, password);
+            return true;
+            
+        case STATE_DECISION:
+            // the operations follow one another on the same connection
+            if(type == FRAME_MAP_REQUEST){
+                if(!session_map_request(s, msg, len))
+                    break;
+                return true;
+            }
+            
+            if(type == FRAME_LIST){
+                if(len != 0)
+                    break;
+                
+                session_list_bookings(s);
+                return true;
+            }
+            
+            if(type == FRAME_SHOWS){
+                if(len != 0)
+                    break;
+                
+                session_list_shows(s);
+                return true;
+            }
+            
+            if(type == FRAME_SHOW){
+                if(len != sizeof(uint32_t))
+                    break;
+                
+                session_select_show(s, get_u32(msg));
+                return true;
+            }
+            
+            if(type == FRAME_SUBSCRIBE){
+                if(len != 0 && len != sizeof(uint64_t))
+                    break;
+                
+                session_subscribe(s, msg, len);
+                return true;
+            }
+            
+            if(type == FRAME_UNSUBSCRIBE){
+                if(len != 0)
+                    break;
+                
+                session_unsubscribe(s);
+                return true;
+            }
+            
+            if(type == FRAME_CANCEL){
+                if(len != CODE_SIZE)
+                    break;
+                
+                memcpy(code, msg, CODE_SIZE);
+                code[CODE_SIZE] = '\0';
+                
+                session_cancel(s, code);
+                return true;
+            }
+            
+            if(type == FRAME_BOOK_BEST){
+                if(len != 3 * sizeof(uint32_t) + sizeof(char))
+                    break;
+                
+                s->bookings = get_u32(msg);
+                s->adjacent = msg[sizeof(uint32_t)] != 0;
+                s->first_row = get_u32(msg + sizeof(uint32_t) + sizeof(char));
+                s->last_row = get_u32(msg + 2 * sizeof(uint32_t) + sizeof(char));
+                
+                if(s->first_row == 0)
+                    s->first_row = 1;
+                if(s->last_row == 0)
+                    s->last_row = show->n;
+                
+                // the rows come from the client, as unsigned: out of range once
+                // read back as int; more seats than there are are just not found
+                if(s->bookings <= 0 || s->first_row < 1 || s->last_row < 1 || s->first_row > s->last_row || s->last_row > show->n){
+                    puts("server: wrong best seats request.");
+                    s->state = STATE_CLOSING;
+                    return true;
+                }
+                
+                s->best = true;
+                s->attempts = 0;
+                session_book_best(s);
+                return true;
+            }
+            
+            if(type != FRAME_BOOK || len < sizeof(uint64_t) + sizeof(uint32_t))
+                break;
+            
+            s->version = get_u64(msg);
+            s->bookings = get_u32(msg + sizeof(uint64_t));
+            
+            if(s->bookings <= 0 || s->bookings > show->n * show->m || len != sizeof(uint64_t) + sizeof(uint32_t) * (s->bookings + 1)){
+                puts("server: wrong number of seats.");
+                s->state = STATE_CLOSING;
+                return true;
+            }
+            
+            if((s->seats_array = malloc(s->bookings * sizeof(int))) == NULL)
+                error("server: memory allocation failed.");
+            
+            for(int i=0; i<s->bookings; i++)
+                s->seats_array[i] = get_u32(msg + sizeof(uint64_t) + sizeof(uint32_t) * (i + 1));
+            
+            s->received = s->bookings;
+            session_book(s);
+            return true;
+    }
+    
+    puts("server: unexpected message");
+    s->state = STATE_CLOSING;
+    return true;
+}
+
+
+
+
+// sends the whole map, or only the flips since the version the
+// client has; false if the request is malformed
+bool session_map_request(session_t *s, char *msg, uint32_t len){
+    unsigned long version;
+    
+    if(len == sizeof(uint64_t))
+        version = session_send_delta(s, get_u64(msg));
+    else if(len == 0)
+        version = session_send_map(s);
+    else
+        return false;
+    
+    // the next pushes start from the map just sent
+    if(s->subscribed)
+        s->pushed_version = version;
+    
+    return true;
+}
+
+
+
+
+// answers as a map request, then the seat changes are pushed to the client
+void session_subscribe(session_t *s, char *msg, uint32_t len){
+    show_t *show = s->show;
+    
+    // a subscriber holds its worker: half of them are left to the other clients
+    if(!s->subscribed && server_mode == SERVER_MODE_THREADS && __atomic_fetch_add(&threads_subscribers, 1, __ATOMIC_RELAXED) >= pool.size / 2){
+        __atomic_fetch_sub(&threads_subscribers, 1, __ATOMIC_RELAXED);
+        session_frame_header(s, FRAME_UNSUBSCRIBE, 0);
+        return;
+    }
+    
+    // linked before the map is sent: the changes committed meanwhile wake it up
+    if(!s->subscribed){
+        pthread_mutex_lock(&show->subscribers_mutex);
+        
+        s->sub_prev = NULL;
+        s->sub_next = show->subscribers;
+        if(show->subscribers != NULL)
+            show->subscribers->sub_prev = s;
+        show->subscribers = s;
+        
+        pthread_mutex_unlock(&show->subscribers_mutex);
+    }
+    
+    s->subscribed = true;
+    session_map_request(s, msg, len);
+}
+
+
+
+
+// the client discards the pushes until the echo of its request
+void session_unsubscribe(session_t *s){
+    if(s->subscribed)
+        remove_subscriber(s);
+    
+    session_frame_header(s, FRAME_UNSUBSCRIBE, 0);
+}
+
+
+
+
+void remove_subscriber(session_t *s){
+    show_t *show = s->show;
+    
+    pthread_mutex_lock(&show->subscribers_mutex);
+    
+    if(s->sub_prev != NULL)
+        s->sub_prev->sub_next = s->sub_next;
+    else
+        show->subscribers = s->sub_next;
+    if(s->sub_next != NULL)
+        s->sub_next->sub_prev = s->sub_prev;
+    
+    pthread_mutex_unlock(&show->subscribers_mutex);
+    
+    if(server_mode == SERVER_MODE_THREADS)
+        __atomic_fetch_sub(&threads_subscribers, 1, __ATOMIC_RELAXED);
+    
+    s->subscribed = false;
+}
+
+
+
+
+// sends the subscribed client the flips since its version: the frame of the
+// last version is shared by all the subscribers, the ones behind it get
+// the flips they missed coalesced in one delta
+void session_push(session_t *s){
+    show_t *show = s->show;
+    
+    // the output isn't piled up behind a client not reading
+    if(s->out_len > 0 || s->writing){
+        s->push_deferred = true;
+        return;
+    }
+    
+    pthread_mutex_lock(&show->subscribers_mutex);
+    
+    if(show->push_frame != NULL && show->push_version == s->pushed_version + 1){
+        session_write(s, show->push_frame, show->push_len);
+        s->pushed_version = show->push_version;
+        
+        pthread_mutex_unlock(&show->subscribers_mutex);
+        return;
+    }
+    
+    pthread_mutex_unlock(&show->subscribers_mutex);
+    
+    if(s->pushed_version != map_version(show))
+        s->pushed_version = session_send_delta(s, s->pushed_version);
+}
+
+
+
+
+// the cancellation works on the account of the current thread
+void session_cancel(session_t *s, char *code){
+    char removed;
+    
+    current_account = s->account;
+    removed = remove_booking(code);
+    current_account = NULL;
+    
+    if(s->protocol == PROTOCOL_V2){
+        session_frame_header(s, FRAME_CANCEL_RESULT, sizeof(char));
+        session_write(s, &removed, sizeof(char));
+        
+        s->state = STATE_DECISION;
+    } else {
+        session_write(s, removed ? "1" : "0", sizeof(char));                              // write 0.2
+        s->state = STATE_CLOSING;
+    }
+}
+
+
+
+
+// sends the size of each show's hall and its free seats
+void session_list_shows(session_t *s){
+    char *frame;
+    char *end;
+    
+    if((frame = malloc(sizeof(uint32_t) * (1 + 3 * shows_count))) == NULL)
+        error("server: memory allocation failed");
+    
+    end = put_u32(frame, shows_count);
+    
+    for(int i=0; i<shows_count; i++){
+        end = put_u32(end, shows[i].n);
+        end = put_u32(end, shows[i].m);
+        end = put_u32(end, __atomic_load_n(&shows[i].hall_free, __ATOMIC_ACQUIRE));
+    }
+    
+    session_frame_header(s, FRAME_SHOWS, end - frame);
+    session_write(s, frame, end - frame);
+    
+    free(frame);
+}
+
+
+
+
+// the next operations of the session work on the chosen show, which
+// can't change while its seats are pushed
+void session_select_show(session_t *s, uint32_t number){
+    char selected = number < (uint32_t) shows_count && !s->subscribed;
+    
+    if(selected)
+        s->show = &shows[number];
+    
+    session_frame_header(s, FRAME_SHOW, sizeof(char));
+    session_write(s, &selected, sizeof(char));
+}
+
+
+
+
+// sends the codes of the account's bookings, each one with its seats
+void session_list_bookings(session_t *s){
+    booking_t *booking;
+    show_t *show;
+    char *code;
+    char *frame;
+    char *end;
+    uint32_t count = 0;
+    size_t size;
+    size_t capacity;
+    size_t used;
+    
+    // the list doesn't change meanwhile, as for the cancellations
+    current_account = s->account;
+    wait_for_token(DELETING_CRITICAL_SECTION_INDEX);
+    
+    // the seats are added as the bookings are found
+    capacity = size = sizeof(uint32_t) + s->account->codes_count * (CODE_SIZE + 2 * sizeof(uint32_t));
+    
+    if((frame = malloc(capacity)) == NULL)
+        error("server: memory allocation failed");
+    
+    end = frame + sizeof(uint32_t);
+    
+    // the newest first
+    for(int i = s->account->codes_count - 1; i >= 0; i--, count++){
+        code = s->account->codes[i].code;
+        show = &shows[s->account->codes[i].show];
+        memcpy(end, code, CODE_SIZE);
+        end += CODE_SIZE;
+        
+        // only the show of the booking is locked
+        pthread_rwlock_rdlock(&show->booking_index_lock);
+        
+        if((booking = find_booking(show, code)) != NULL){
+            if((size += booking->count * sizeof(uint32_t)) > capacity){
+                used = end - frame;
+                capacity = size * 2;
+                
+                if((frame = realloc(frame, capacity)) == NULL)
+                    error("server: memory allocation failed");
+                end = frame + used;
+            }
+            
+            end = put_u32(end, show->number);
+            end = put_u32(end, booking->count);
+            for(int j=0; j<booking->count; j++)
+                end = put_u32(end, booking->seats[j]);
+        }
+        
+        pthread_rwlock_unlock(&show->booking_index_lock);
+        
+        if(booking == NULL){
+            end = put_u32(end, 0);
+            end = put_u32(end, 0);
+        }
+    }
+    
+    release_token(DELETING_CRITICAL_SECTION_INDEX);
+    current_account = NULL;
+    
+    put_u32(frame, count);
+    
+    session_frame_header(s, FRAME_BOOKINGS, end - frame);
+    session_write(s, frame, end - frame);
+    
+    free(frame);
+}
+
+
+
+
+// signs the user up or in
+void session_access(session_t *s, char *password){
+    char username[MAX_INPUT_SIZE];
+    char frame[1 + sizeof(uint16_t) + MAX_INPUT_SIZE];
+    char *end = frame;
+    
+    s->account = NULL;
+    
+    if(s->access_type == WANT_TO_SIGN_UP){
+        // NULL if the email is taken, by a parallel signup too
+        s->account = add_account(s->username, s->email, password, 0);
+        
+#ifdef DEBUG
+        print_accounts();
+#endif
+    } else
+        s->account = check_account_exists(s->email, password);
+    
+    if(s->protocol == PROTOCOL_V2){
+        *end++ = s->account != NULL;
+        if(s->account != NULL && s->access_type == WANT_TO_SIGN_IN)
+            end = put_str(end, s->account->nickname);
+        
+        session_frame_header(s, FRAME_ACCESS, end - frame);
+        session_write(s, frame, end - frame);
+        
+        s->state = s->account != NULL ? STATE_DECISION : STATE_ACCESS;
+        return;
+    }
+    
+    // sending the result to the client
+    session_write(s, s->account != NULL ? "1" : "0", sizeof(char));                       // write -2.2
+    
+    if(s->account == NULL){
+        s->state = STATE_EMAIL;
+        return;
+    }
+    
+    if(s->access_type == WANT_TO_SIGN_IN){
+        bzero(username, MAX_INPUT_SIZE);
+        strncpy(username, s->account->nickname, MAX_INPUT_SIZE - 1);
+        session_write(s, username, MAX_INPUT_SIZE * sizeof(char));                        // write -2.3
+    }
+    
+    s->state = STATE_DECISION;
+}
+
+
+
+
+// appends the seats map, a legacy session is closed if the cinema is full;
+// returns the version sent
+unsigned long session_send_map(session_t *s){
+    show_t *show = s->show;
+    char *snapshot;
+    char version[VERSION_SIZE];
+    char header[2 * sizeof(uint32_t) + sizeof(uint64_t) + sizeof(char)];
+    char *encoded;
+    size_t encoded_len;
+    unsigned long current;
+    
+    if((snapshot = malloc(show->n * show->m * sizeof(char))) == NULL)
+        error("server: memory allocation failed");
+    
+    current = snapshot_map(show, snapshot);
+    
+    if(s->protocol == PROTOCOL_V2){
+        encoded_len = encode_map(show, snapshot, s->map_encodings, put_u64(put_u32(put_u32(header, show->n), show->m), current), &encoded);
+        
+        session_frame_header(s, FRAME_MAP, sizeof(header) + encoded_len);
+        session_write(s, header, sizeof(header));
+        session_write(s, encoded != NULL ? encoded : snapshot, encoded_len);
+        
+        free(encoded);
+    } else {
+        bzero(version, VERSION_SIZE);
+        snprintf(version, VERSION_SIZE, "%lu", current);
+        
+        session_write(s, snapshot, show->n * show->m * sizeof(char));                                  // write 3
+        session_write(s, version, VERSION_SIZE);                                           // write 3.1
+    }
+    
+    free(snapshot);
+    
+    if(__atomic_load_n(&show->hall_free, __ATOMIC_ACQUIRE) == 0 && s->protocol == PROTOCOL_LEGACY)
+        s->state = STATE_CLOSING;
+    
+    return current;
+}
+
+
+
+
+
+// appends the flips since the client's version, falling back to the whole
+// map when the log doesn't have them all or they outnumber the seats; the
+// client, having the whole map, sees itself when the hall is full;
+// returns the version sent
+unsigned long session_send_delta(session_t *s, unsigned long since){
+    show_t *show = s->show;
+    change_t *changes;
+    unsigned long current;
+    char *frame;
+    char *end;
+    int count;
+    
+    if((changes = changes_since(show, since, &current, &count)) == NULL || count > show->n * show->m){
+        free(changes);
+        return session_send_map(s);
+    }
+    
+    // a varint is 5 bytes at most
+    if((frame = malloc(2 * sizeof(uint32_t) + 2 * sizeof(uint64_t) + sizeof(uint32_t) + count * 5)) == NULL)
+        error("server: memory allocation failed");
+    
+    end = put_u32(put_u64(put_u64(put_u32(put_u32(frame, show->n), show->m), since), current), count);
+    
+    for(int i=0; i<count; i++)
+        end = put_varint(end, changes[i].seat * 2 + changes[i].taken);
+    
+    session_frame_header(s, FRAME_MAP_DELTA, end - frame);
+    session_write(s, frame, end - frame);
+    
+    free(changes);
+    free(frame);
+    
+    return current;
+}
+
+
+
+
+// encodes the map as the client accepts it: the runs of free and taken seats
+// are sent only when they are shorter than the other encoding; encoded is
+// NULL for the raw map, that is the snapshot itself
+size_t encode_map(show_t *show, const char *snapshot, int encodings, char *encoding, char **encoded){
+    size_t bitmap_len = (show->n * show->m + 7) / 8;
+    size_t limit = encodings & MAP_ENCODING_BITMAP ? bitmap_len : (size_t) show->n * show->m;
+    char *end;
+    uint32_t run = 0;
+    char current = '0';
+    int i;
+    
+    *encoded = NULL;
+    *encoding = MAP_ENCODING_RAW;
+    
+    if(encodings == 0)
+        return show->n * show->m;
+    
+    // a varint is 5 bytes at most, the runs are abandoned once past the limit:
+    // the last one in the loop and the closing one can both overrun it
+    if((*encoded = malloc(limit + 2 * 5)) == NULL)
+        error("server: memory allocation failed");
+    
+    if(encodings & MAP_ENCODING_RLE){
+        end = *encoded;
+        
+        for(i=0; i<show->n*show->m && (size_t) (end - *encoded) < limit; i++){
+            if(snapshot[i] != current){
+                end = put_varint(end, run);
+                current = snapshot[i];
+                run = 0;
+            }
+            run++;
+        }
+        end = put_varint(end, run);
+        
+        if(i == show->n * show->m && (size_t) (end - *encoded) < limit){
+            *encoding = MAP_ENCODING_RLE;
+            return end - *encoded;
+        }
+    }
+    
+    if(!(encodings & MAP_ENCODING_BITMAP)){
+        free(*encoded);
+        *encoded = NULL;
+        return show->n * show->m;
+    }
+    
+    bzero(*encoded, bitmap_len);
+    for(i=0; i<show->n*show->m; i++){
+        if(snapshot[i] != '0')
+            (*encoded)[i / 8] |= 1 << i % 8;
+    }
+    
+    *encoding = MAP_ENCODING_BITMAP;
+    return bitmap_len;
+}
+
+
+
+
+// books the received seats; with the locking engine the session
+// queues on the rows of the booking, and it is resumed once it gets them
+void session_book(session_t *s){
+    show_t *show = s->show;
+    int row;
+    
+    if(!check_seats(show, s->seats_array, s->bookings)){
+        puts("server: wrong seat number.");
+        s->state = STATE_CLOSING;
+        return;
+    }
+    
+    // a failure on a stale map is told apart from a wrong choice
+    s->stale = s->version != map_version(show);
+    
+    if(booking_engine == BOOKING_ENGINE_OPTIMISTIC){
+        session_answer(s, book_seats_optimistic(show, s->seats_array, s->bookings));
+        return;
+    }
+    
+    if((s->rows = malloc(s->bookings * sizeof(int))) == NULL)
+        error("server: memory allocation failed");
+    
+    // always in ascending row order, to avoid deadlocks between overlapping
+    // bookings: the seats are sorted by check_seats()
+    s->rows_count = 0;
+    for(int i=0; i<s->bookings; i++){
+        row = (s->seats_array[i] - 1) / SEATS_PER_STRIPE(show);
+        
+        if(s->rows_count == 0 || s->rows[s->rows_count - 1] != row)
+            s->rows[s->rows_count++] = row;
+    }
+    
+    s->rows_held = 0;
+    s->state = STATE_LOCKING;
+    session_resume(s);
+}
+
+
+
+
+// picks the seats of a best seats request and books them as if the client
+// chose them on the current map
+void session_book_best(session_t *s){
+    show_t *show = s->show;
+    
+    s->version = map_version(show);
+    
+    // more seats than the hall has are never found
+    if(s->bookings <= show->n * show->m && (s->seats_array = malloc(s->bookings * sizeof(int))) == NULL)
+        error("server: memory allocation failed");
+    
+    if(s->seats_array == NULL || !pick_best_seats(show, s->bookings, s->adjacent, s->first_row - 1, s->last_row - 1, s->seats_array)){
+        s->attempts = BEST_ATTEMPTS;
+        s->stale = false;
+        session_answer(s, false);
+        return;
+    }
+    
+    session_book(s);
+}
+
+
+
+
+// goes on with a queued booking, until it gets all its rows or it has to wait again
+void session_resume(session_t *s){
+    show_t *show = s->show;
+    bool booked;
+    
+    if(s->state != STATE_LOCKING || !session_lock_rows(s))
+        return;
+    
+    booked = book_locked_seats(show, s->seats_array, s->bookings);
+    session_unlock_rows(s);
+    
+    session_answer(s, booked);
+}
+
+
+
+
+void session_answer(session_t *s, bool booked){
+    show_t *show = s->show;
+    char code[CODE_SIZE + 1];
+    char result = booked ? BOOK_RESULT_BOOKED : s->stale ? BOOK_RESULT_STALE : BOOK_RESULT_TAKEN;
+    char answer[2] = { '0' + result, '\0' };
+    char *seats, *end;
+    uint32_t len = booked ? 1 + CODE_SIZE : 1;
+    
+    // the seats picked were taken meanwhile, others are picked
+    if(!booked && s->best && ++s->attempts < BEST_ATTEMPTS){
+        free(s->seats_array);
+        s->seats_array = NULL;
+        session_book_best(s);
+        return;
+    }
+    
+    if(booked && s->best)
+        len += sizeof(uint32_t) * (s->bookings + 1);
+    
+    if(s->protocol == PROTOCOL_V2){
+        session_frame_header(s, FRAME_RESULT, len);
+        session_write(s, &result, sizeof(char));
+    } else {
+        session_write(s, "1", sizeof(char));                                               // write semaphore state (1)
+        session_write(s, answer, 2 * sizeof(char));                                        // write 6
+    }
+    
+    if(booked){
+        puts("Input gone well");
+        s->loop->bookings++;
+        
+        // minted only now, the failed attempts don't use up any code
+        get_random_code(code);
+        fill_bookings(show, s->seats_array, s->bookings, code);
+        
+        printf("code sent to the client: %s\n", code);
+        fflush(stdout);
+        
+        session_write(s, code, CODE_SIZE * sizeof(char));                                  // write 8
+        
+        // the client didn't choose them
+        if(s->best){
+            if((seats = malloc(sizeof(uint32_t) * (s->bookings + 1))) == NULL)
+                error("server: memory allocation failed");
+            
+            end = put_u32(seats, s->bookings);
+            for(int i=0; i<s->bookings; i++)
+                end = put_u32(end, s->seats_array[i]);
+            
+            session_write(s, seats, end - seats);
+            free(seats);
+        }
+        
+        // other sessions of the same account may be listing or cancelling
+        current_account = s->account;
+        wait_for_token(DELETING_CRITICAL_SECTION_INDEX);
+        add_reservation(s->account, code, show->number);
+        release_token(DELETING_CRITICAL_SECTION_INDEX);
+        current_account = NULL;
+        
+        s->state = STATE_CLOSING;
+    } else
+        s->state = STATE_RETRY;
+    
+    // a v2 session goes on with the next operation
+    if(s->protocol == PROTOCOL_V2)
+        s->state = STATE_DECISION;
+    
+    free(s->seats_array);
+    s->seats_array = NULL;
+    s->best = false;
+}
+
+
+
+
+// acquires the rows of the booking one after the other: when one is busy
+// the session queues on it and false is returned, the holder will wake
+// the session up releasing it
+bool session_lock_rows(session_t *s){
+    show_t *show = s->show;
+    stripe_t *stripe;
+    long position;
+    long estimate;
+    
+    while(s->rows_held < s->rows_count){
+        stripe = &show->stripes[s->rows[s->rows_held]];
+        
+        pthread_mutex_lock(&stripe->mutex);
+        
+        if(!s->waiting){
+            if(!stripe->busy && stripe->head == NULL){
+                stripe->busy = true;
+                clock_gettime(CLOCK_MONOTONIC, &stripe->acquired_at);
+            } else {
+                s->waiter.session = s;
+                s->waiter.granted = false;
+                s->waiter.ticket = stripe->next_ticket++;
+                s->waiter.next = NULL;
+                
+                if(stripe->tail == NULL)
+                    stripe->head = &s->waiter;
+                else
+                    stripe->tail->next = &s->waiter;
+                stripe->tail = &s->waiter;
+                
+                s->waiting = true;
+                s->sent_position = 0;
+            }
+        }
+        
+        if(s->waiting && !s->waiter.granted){
+            // 1 means "next one to be served"
+            position = s->waiter.ticket - stripe->served + 1;
+            estimate = position * stripe->avg_hold_ms;
+            
+            pthread_mutex_unlock(&stripe->mutex);
+            
+            if(position != s->sent_position){
+                session_queue_state(s, position, estimate);
+                s->sent_position = position;
+            }
+            return false;
+        }
+        
+        pthread_mutex_unlock(&stripe->mutex);
+        
+        s->waiting = false;
+        s->rows_held++;
+    }
+    
+    return true;
+}
+
+
+
+
+// releases the rows held and leaves the queue the session is waiting in
+void session_unlock_rows(session_t *s){
+    show_t *show = s->show;
+    stripe_t *stripe;
+    stripe_waiter_t **curr;
+    
+    if(s->waiting){
+        stripe = &show->stripes[s->rows[s->rows_held]];
+        
+        pthread_mutex_lock(&stripe->mutex);
+        
+        // handed off meanwhile, it is released as the others
+        if(s->waiter.granted)
+            s->rows_held++;
+        else {
+            for(curr = &stripe->head; *curr != &s->waiter; curr = &(*curr)->next);
+            
+            *curr = s->waiter.next;
+            
+            if(stripe->tail == &s->waiter){
+                stripe->tail = stripe->head;
+                while(stripe->tail != NULL && stripe->tail->next != NULL)
+                    stripe->tail = stripe->tail->next;
+            }
+        }
+        
+        pthread_mutex_unlock(&stripe->mutex);
+        s->waiting = false;
+    }
+    
+    for(int i=s->rows_held-1; i>=0; i--)
+        release_stripe(show, s->rows[i]);
+    
+    free(s->rows);
+    s->rows = NULL;
+    s->rows_count = s->rows_held = 0;
+}
+
+
+
+
+// sends to the client the state "0" followed by its position in
+// the queue and the estimated waiting time in milliseconds, or a
+// FRAME_QUEUE to a v2 client
+void session_queue_state(session_t *s, long position, long estimate){
+    char buff[1 + 2 * QUEUE_FIELD_SIZE];
+    
+    if(s->protocol == PROTOCOL_V2){
+        put_u32(put_u32(buff, position), estimate);
+        
+        session_frame_header(s, FRAME_QUEUE, 2 * sizeof(uint32_t));
+        session_write(s, buff, 2 * sizeof(uint32_t));
+        return;
+    }
+    
+    bzero(buff, sizeof(buff));
+    buff[0] = '0';
+    snprintf(buff + 1, QUEUE_FIELD_SIZE, "%ld", position);
+    snprintf(buff + 1 + QUEUE_FIELD_SIZE, QUEUE_FIELD_SIZE, "%ld", estimate);
+    
+    session_write(s, buff, sizeof(buff));                                                  // write semaphore state (0)
+}
+
+
+
+
+// takes a closing session out of the rows' queues and of its loop's wakeups
+void session_detach(session_t *s){
+    session_t **curr;
+    
+    if(s->rows != NULL)
+        session_unlock_rows(s);
+    
+    if(s->subscribed)
+        remove_subscriber(s);
+    
+    pthread_mutex_lock(&s->loop->wake_mutex);
+    
+    if(s->wake_pending){
+        for(curr = &s->loop->woken; *curr != s; curr = &(*curr)->wake_next);
+        *curr = s->wake_next;
+        s->wake_pending = false;
+    }
+    
+    pthread_mutex_unlock(&s->loop->wake_mutex);
+}
+
+
+
+
+void startup_wakeups(event_loop_t *loop){
+    if((loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+        error("server: eventfd creation failed");
+    
+    pthread_mutex_init(&loop->wake_mutex, NULL);
+    loop->woken = NULL;
+}
+
+
+
+
+// schedules the session to be resumed by its loop, from any thread: the
+// loop is signalled only when its list was empty, a fan-out to many
+// sessions of the same loop costs one write
+void wake_session(session_t *s){
+    event_loop_t *loop = s->loop;
+    uint64_t one = 1;
+    bool signal = false;
+    
+    pthread_mutex_lock(&loop->wake_mutex);
+    
+    if(!s->wake_pending){
+        signal = loop->woken == NULL;
+        s->wake_pending = true;
+        s->wake_next = loop->woken;
+        loop->woken = s;
+    }
+    
+    pthread_mutex_unlock(&loop->wake_mutex);
+    
+    // EAGAIN: the counter is full, the loop is going to wake up anyway
+    if(signal && write(loop->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        error("server: wakeup failed");
+}
+
+
+
+
+// resumes the woken sessions one at a time: resuming a session can
+// wake other ones up, releasing its rows
+void run_wakeups(event_loop_t *loop){
+    session_t *s;
+    
+    while(1){
+        pthread_mutex_lock(&loop->wake_mutex);
+        
+        if((s = loop->woken) != NULL){
+            loop->woken = s->wake_next;
+            s->wake_pending = false;
+        }
+        
+        pthread_mutex_unlock(&loop->wake_mutex);
+        
+        if(s == NULL)
+            return;
+        
+        // the pushes are no sign of life from the client
+        if(!s->subscribed || s->state == STATE_LOCKING)
+            session_touch(s, time(NULL));
+        
+        if(s->subscribed)
+            session_push(s);
+        session_resume(s);
+        
+        // the messages received meanwhile are handled now
+        if(session_input(s, 0))
+            backend->flush(s);
+        else
+            backend->close(s);
+    }
+}
+
+
+
+
+// gathers the output of the step, sent all together by the backend's flush
+void session_write(session_t *s, const char *data, size_t len){
+    s->loop->writes++;
+    
+    if(s->out_len + len > s->out_size){
+        s->out_size = (s->out_len + len) * 2;
+        
+        if((s->out = realloc(s->out, s->out_size)) == NULL)
+            error("server: memory allocation failed");
+    }
+    
+    memcpy(s->out + s->out_len, data, len);
+    s->out_len += len;
+}
+
+
+
+
+
+// appends the header of a frame, its payload is appended by the caller
+void session_frame_header(session_t *s, int type, uint32_t len){
+    char header[FRAME_HEADER_SIZE];
+    
+    put_frame_header(header, type, len);
+    session_write(s, header, FRAME_HEADER_SIZE);
+}
+
+
+
+
+// sends as much output as the socket accepts, waiting for EPOLLOUT for the rest
+void epoll_flush(session_t *s){
+    struct epoll_event event;
+    ssize_t res;
+    
+    while(s->out_sent < s->out_len){
+        s->loop->syscalls++;
+        s->loop->sends++;
+        res = send(s->conn_s, s->out + s->out_sent, s->out_len - s->out_sent, MSG_NOSIGNAL);
+        
+        if(res == -1){
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN)
+                break;
+            
+            session_free(s);
+            return;
+        }
+        
+        s->out_sent += res;
+    }
+    
+    if(s->out_sent == s->out_len){
+        s->out_sent = s->out_len = 0;
+        
+        if(s->state == STATE_CLOSING){
+            session_free(s);
+            return;
+        }
+        
+        if(s->push_deferred){
+            s->push_deferred = false;
+            wake_session(s);
+        }
+    }
+    
+    // listening for EPOLLOUT only while there is something left to send
+    if(s->want_write != (s->out_len > 0)){
+        s->want_write = s->out_len > 0;
+        
+        event.events = s->want_write ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        event.data.ptr = s;
+        
+        s->loop->syscalls++;
+        if(epoll_ctl(s->loop->epfd, EPOLL_CTL_MOD, s->conn_s, &event) == -1)
+            error("server: epoll control operation failed");
+    }
+}
+
+
+
+
+
+// maps the rings of a new io_uring instance and registers the
+// input buffers of the sessions; without the registration (memlock
+// limits) plain reads are used
+void uring_startup(event_loop_t *loop){
+    uring_t *ring = &loop->ring;
+    struct io_uring_params params;
+    struct iovec iov;
+    char *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    
+    memset(&params, 0, sizeof(params));
+    
+    if((ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) == -1)
+        error("server: io_uring setup failed");
+    
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    
+    // both the rings can share a single mapping
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        if(cq_size > sq_size)
+            sq_size = cq_size;
+        cq_size = sq_size;
+    }
+    
+    if((sq_ptr = mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+        error("server: io_uring memory mapping failed");
+    
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ptr = sq_ptr;
+    else if((cq_ptr = mmap(NULL, cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+        error("server: io_uring memory mapping failed");
+    
+    if((ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES)) == MAP_FAILED)
+        error("server: io_uring memory mapping failed");
+    
+    ring->sq_head = (unsigned *) (sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq_ptr + params.sq_off.tail);
+    ring->sq_array = (unsigned *) (sq_ptr + params.sq_off.array);
+    ring->sq_mask = *(unsigned *) (sq_ptr + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *) (cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq_ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq_ptr + params.cq_off.cqes);
+    
+    if((loop->buffers = mmap(NULL, URING_SESSIONS * SESSION_BUFFER_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+        error("server: memory mapping failed");
+    
+    if((loop->free_slots = malloc(URING_SESSIONS * sizeof(int))) == NULL)
+        error("server: memory allocation failed");
+    
+    for(int i=0; i<URING_SESSIONS; i++)
+        loop->free_slots[i] = URING_SESSIONS - 1 - i;
+    loop->free_count = URING_SESSIONS;
+    
+    iov.iov_base = loop->buffers;
+    iov.iov_len = URING_SESSIONS * SESSION_BUFFER_SIZE;
+    
+    if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) == -1){
+        printf("server: io_uring buffers registration failed (%s), using plain reads\n", strerror(errno));
+        fflush(stdout);
+        loop->fixed_buffers = false;
+    } else
+        loop->fixed_buffers = true;
+    
+    loop->tick.tv_sec = 1;
+    loop->tick.tv_nsec = 0;
+    
+    startup_wakeups(loop);
+}
+
+
+
+
+void *uring_run(void *arg){
+    event_loop_t *loop = (event_loop_t *) arg;
+    uring_t *ring = &loop->ring;
+    struct io_uring_cqe cqe;
+    unsigned head;
+    time_t now;
+    
+    // io_uring loops accept by themselves: every listener gets a loop,
+    // the loops in excess share them
+    for(int j = (loop - event_loops) % listeners_count; j < listeners_count; j += event_loops_count)
+        uring_accept(loop, &listeners[j]);
+    
+    // a kernel without multishot accepts refuses them on submission: their
+    // completions are already there, and the loop falls back to single ones
+    uring_submit(loop, 0);
+    
+    uring_tick(loop);
+    uring_wake(loop);
+    
+    while(1){
+        // everything prepared since the last round is submitted together
+        uring_submit(loop, 1);
+        
+        now = time(NULL);
+        head = *ring->cq_head;
+        
+        while(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)){
+            cqe = ring->cqes[head & ring->cq_mask];
+            __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+            
+            uring_complete(loop, &cqe, now);
+        }
+        
+        expire_sessions(loop, now);
+    }
+    
+    return NULL;
+}
+
+
+
+
+void uring_complete(event_loop_t *loop, struct io_uring_cqe *cqe, time_t now){
+    session_t *s = (session_t *) (uintptr_t) (cqe->user_data & ~(__u64) URING_OP_MASK);
+    listener_t *listener;
+    
+    switch(cqe->user_data & URING_OP_MASK){
+        case URING_ACCEPT:
+            listener = (listener_t *) (uintptr_t) (cqe->user_data & ~(__u64) URING_OP_MASK);
+            
+            if(cqe->res >= 0)
+                uring_add(loop, cqe->res);
+            
+            // the accept stopped: rearmed now when it ended well, at the next
+            // tick on errors like EMFILE, which would come back at once
+            if(cqe->flags & IORING_CQE_F_MORE)
+                break;
+            
+            if(cqe->res == -EINVAL && !loop->single_accept){
+                puts("server: no multishot accept in this kernel, accepting one connection at a time");
+                fflush(stdout);
+                loop->single_accept = true;
+                uring_accept(loop, listener);
+            } else if(cqe->res >= 0 || cqe->res == -EINTR || cqe->res == -EAGAIN || cqe->res == -ECONNABORTED)
+                uring_accept(loop, listener);
+            else {
+                printf("server: error during the accept (%s)\n", strerror(-cqe->res));
+                fflush(stdout);
+                loop->accepts_paused |= 1ULL << listener->index;
+                loop->accepts_retry = now + 1;
+            }
+            break;
+            
+        case URING_TICK:
+            // wakes the loop up to close the inactive sessions; the timeout
+            // also ends on other completions, hence the paused accepts' second
+            uring_tick(loop);
+            
+            for(int j=0; loop->accepts_paused != 0 && now >= loop->accepts_retry; j++){
+                if(loop->accepts_paused & 1ULL << j){
+                    loop->accepts_paused &= ~(1ULL << j);
+                    uring_accept(loop, &listeners[j]);
+                }
+            }
+            break;
+            
+        case URING_WAKE:
+            uring_wake(loop);
+            run_wakeups(loop);
+            break;
+            
+        case URING_READ:
+            s->inflight--;
+            
+            if(s->closed){
+                if(s->inflight == 0)
+                    uring_release(s);
+                break;
+            }
+            
+            if(cqe->res == -EINTR || cqe->res == -EAGAIN){
+                uring_read(s);
+                break;
+            }
+            
+            // the client closed the connection or it is broken
+            if(cqe->res <= 0 || !session_input(s, cqe->res)){
+                uring_close(s);
+                break;
+            }
+            
+            session_touch(s, now);
+            
+            if(s->state != STATE_CLOSING)
+                uring_read(s);
+            
+            uring_flush(s);
+            break;
+            
+        case URING_SEND:
+            s->inflight--;
+            s->writing = false;
+            
+            if(s->closed){
+                if(s->inflight == 0)
+                    uring_release(s);
+                break;
+            }
+            
+            if(cqe->res < 0){
+                uring_close(s);
+                break;
+            }
+            
+            s->sending_sent += cqe->res;
+            uring_flush(s);
+            break;
+    }
+}
+
+
+
+
+// gives a free submission queue entry, submitting the full queue if needed
+struct io_uring_sqe *uring_get_sqe(event_loop_t *loop){
+    uring_t *ring = &loop->ring;
+    struct io_uring_sqe *sqe;
+    unsigned index;
+    
+    if(ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries)
+        uring_submit(loop, 0);
+    
+    index = ring->sq_local_tail & ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    ring->to_submit++;
+    
+    return sqe;
+}
+
+
+
+
+// submits the prepared entries with a single syscall,
+// waiting for at least wait completions
+void uring_submit(event_loop_t *loop, unsigned wait){
+    uring_t *ring = &loop->ring;
+    long res;
+    
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    
+    loop->syscalls++;
+    while((res = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) == -1){
+        // EBUSY: the completions have to be consumed first
+        if(errno == EBUSY)
+            return;
+        if(errno != EINTR && errno != EAGAIN)
+            error("server: io_uring enter failed");
+    }
+    
+    ring->to_submit -= res;
+}
+
+
+
+
+// the listener is in the user data, to rearm the accept when it stops
+void uring_accept(event_loop_t *loop, listener_t *listener){
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener->list_s;
+    sqe->ioprio = loop->single_accept ? 0 : IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = (uintptr_t) listener | URING_ACCEPT;
+}
+
+
+
+
+void uring_tick(event_loop_t *loop){
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t) &loop->tick;
+    sqe->len = 1;
+    sqe->user_data = URING_TICK;
+}
+
+
+
+
+
+// reads the eventfd the other threads write waking sessions up
+void uring_wake(event_loop_t *loop){
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->wake_fd;
+    sqe->addr = (uintptr_t) &loop->wake_value;
+    sqe->len = sizeof(loop->wake_value);
+    sqe->user_data = URING_WAKE;
+}
+
+
+
+
+void uring_add(event_loop_t *loop, int conn_s){
+    session_t *s;
+    
+    if(loop->free_count == 0){
+        puts("server: too many sessions, connection refused");
+        fflush(stdout);
+        loop->syscalls++;
+        close(conn_s);
+        return;
+    }
+    
+    puts("server: connection accepted");
+    fflush(stdout);
+    
+    loop->syscalls++;
+    set_nodelay(conn_s);
+    
+    s = session_new(loop, conn_s);
+    s->slot = loop->free_slots[--loop->free_count];
+    s->in = loop->buffers + s->slot * SESSION_BUFFER_SIZE;
+    
+    session_touch(s, time(NULL));
+    uring_read(s);
+}
+
+
+
+
+// reads in the free part of the session's buffer
+void uring_read(session_t *s){
+    struct io_uring_sqe *sqe = uring_get_sqe(s->loop);
+    
+    sqe->opcode = s->loop->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = s->conn_s;
+    sqe->addr = (uintptr_t) (s->in + s->in_start + s->in_len);
+    sqe->len = SESSION_BUFFER_SIZE - s->in_start - s->in_len;
+    sqe->buf_index = 0;
+    sqe->user_data = (uintptr_t) s | URING_READ;
+    
+    s->inflight++;
+}
+
+
+
+
+// sends the output, one batch at a time: what is written while a send
+// is in flight waits in s->out, while the kernel reads s->sending
+void uring_flush(session_t *s){
+    struct io_uring_sqe *sqe;
+    char *tmp;
+    size_t tmp_size;
+    
+    if(s->closed || s->writing)
+        return;
+    
+    if(s->sending_sent == s->sending_len){
+        s->sending_sent = s->sending_len = 0;
+        
+        if(s->out_len == 0){
+            if(s->state == STATE_CLOSING)
+                uring_close(s);
+            else if(s->push_deferred){
+                s->push_deferred = false;
+                wake_session(s);
+            }
+            return;
+        }
+        
+        tmp = s->sending;
+        tmp_size = s->sending_size;
+        s->sending = s->out;
+        s->sending_size = s->out_size;
+        s->sending_len = s->out_len;
+        s->out = tmp;
+        s->out_size = tmp_size;
+        s->out_len = 0;
+    }
+    
+    sqe = uring_get_sqe(s->loop);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = s->conn_s;
+    sqe->addr = (uintptr_t) (s->sending + s->sending_sent);
+    sqe->len = s->sending_len - s->sending_sent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t) s | URING_SEND;
+    s->loop->sends++;
+    
+    s->writing = true;
+    s->inflight++;
+}
+
+
+
+
+// the session is freed once its inflight operations are completed:
+// shutting the socket down makes them complete
+void uring_close(session_t *s){
+    if(s->closed)
+        return;
+    
+    s->closed = true;
+    session_detach(s);
+    session_unlink(s);
+    
+    puts("server: closed connection");
+    fflush(stdout);
+    
+    s->loop->syscalls++;
+    shutdown(s->conn_s, SHUT_RDWR);
+    
+    if(s->inflight == 0)
+        uring_release(s);
+}
+
+
+
+
+void uring_release(session_t *s){
+    event_loop_t *loop = s->loop;
+    
+    loop->syscalls++;
+    if(close(s->conn_s) < 0)
+        puts("server: closing connection failed.");
+    
+    loop->free_slots[loop->free_count++] = s->slot;
+    
+    free(s->seats_array);
+    free(s->out);
+    free(s->sending);
+    free(s);
+}
+
+
+
+
+// one lock per row of the hall: bookings touching disjoint
+// rows never wait on each other
+void startup_stripes(show_t *show){
+    if((show->stripes = calloc(show->n, sizeof(stripe_t))) == NULL)
+        error("server: memory allocation failed");
+    
+    for(int i=0; i<show->n; i++){
+        if(pthread_mutex_init(&show->stripes[i].mutex, NULL) != 0)
+            error("server: stripe mutex initialization failed");
+        
+        show->stripes[i].max_run = longest_free_run(show, i);
+    }
+}
+
+
+
+
+
+void startup_change_log(show_t *show){
+    if((show->change_log = calloc(CHANGE_LOG_SIZE, sizeof(change_t))) == NULL)
+        error("server: memory allocation failed");
+}
+
+
+
+
+
+// loads the shows from their files, the first one from the files
+// of the single hall
+void startup_shows(){
+    show_t *show;
+    
+    if((shows = calloc(shows_count, sizeof(show_t))) == NULL)
+        error("server: memory allocation failed");
+    
+    for(int i=0; i<shows_count; i++){
+        show = &shows[i];
+        show->number = i;
+        
+        if(i == 0){
+            snprintf(show->seats_file, SHOW_FILE_NAME_SIZE, "%s", SEATS_FILE_NAME);
+            snprintf(show->booking_file, SHOW_FILE_NAME_SIZE, "%s", BOOKING_FILE_NAME);
+        } else {
+            snprintf(show->seats_file, SHOW_FILE_NAME_SIZE, "%s_%d", SEATS_FILE_NAME, i);
+            snprintf(show->booking_file, SHOW_FILE_NAME_SIZE, "%s_%d", BOOKING_FILE_NAME, i);
+        }
+        
+        pthread_rwlock_init(&show->booking_index_lock, NULL);
+        pthread_mutex_init(&show->change_log_mutex, NULL);
+        pthread_mutex_init(&show->subscribers_mutex, NULL);
+        
+        show->cinema = create_struct_file(show);
+        show->booking_addr = create_booking_file(show);
+        startup_booking_index(show);
+        startup_stripes(show);
+        startup_change_log(show);
+    }
+}
+
+
+
+
+// the codes of the earlier runs, in the bookings and in the accounts, are
+// gathered once: the new ones are checked against them without any lock
+void startup_codes(){
+    booking_t *booking;
+    person_t *account;
+    size_t size = 0;
+    
+    if(getrandom(code_keys, sizeof(code_keys), 0) != sizeof(code_keys))
+        error("server: drawing the keys of the codes failed");
+    
+    for(int i=0; i<ACCOUNT_SHARDS; i++)
+        for(size_t j=0; j<account_shards[i].size; j++)
+            for(account = account_shards[i].buckets[j]; account != NULL; account = account->next)
+                size += account->codes_count;
+    
+    for(int k=0; k<shows_count; k++)
+        size += shows[k].n * shows[k].m;
+    
+    if((earlier_codes = malloc((size > 0 ? size : 1) * sizeof(uint64_t))) == NULL)
+        error("server: memory allocation failed");
+    
+    for(int i=0; i<ACCOUNT_SHARDS; i++)
+        for(size_t j=0; j<account_shards[i].size; j++)
+            for(account = account_shards[i].buckets[j]; account != NULL; account = account->next)
+                for(int c=0; c<account->codes_count; c++)
+                    earlier_codes[earlier_codes_count++] = code_value(account->codes[c].code);
+    
+    for(int k=0; k<shows_count; k++)
+        for(size_t i=0; i<shows[k].booking_index_size; i++)
+            for(booking = shows[k].booking_index[i]; booking != NULL; booking = booking->next)
+                earlier_codes[earlier_codes_count++] = code_value(booking->code);
+    
+    qsort(earlier_codes, earlier_codes_count, sizeof(uint64_t), compare_codes);
+}
+
+
+
+
+int compare_codes(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    
+    return (x > y) - (x < y);
+}
+
+
+
+
+void startup_listeners(long port){
+    if(listeners_count == 0){
+        if((listeners_count = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+            listeners_count = 1;
+        else if(listeners_count > MAX_LISTENERS)
+            listeners_count = MAX_LISTENERS;
+    }
+    
+    if((listeners = calloc(listeners_count, sizeof(listener_t))) == NULL)
+        error("server: memory allocation failed");
+    
+    // SO_REUSEPORT would let the group join another server's one
+    check_port_free(port);
+    
+    for(int i=0; i<listeners_count; i++){
+        listeners[i].index = i;
+        startup_connection(&listeners[i].list_s, port);
+    }
+    
+    printf("server: listening from port %ld with %d listeners.\n", port, listeners_count);
+    fflush(stdout);
+}
+
+
+
+
+void startup_connection(int *list_s, long port){
+    struct sockaddr_in listaddr;                // listening socket address
+    
+    // creating the listening socket 
+    if ((*list_s = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        error("server: error creating socket.\n");
+    
+    
+    // resetting serveraddr structure   
+    // and fill it with relevant data
+    memset(&listaddr, 0, sizeof(listaddr));
+    listaddr.sin_family = AF_INET;
+    listaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    listaddr.sin_port = htons(port);
+    
+    
+    // to avoid "Address already in use" error
+    int optval = 1;
+    setsockopt(*list_s, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+    
+    // the other listeners bind the same port
+    if (setsockopt(*list_s, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int)) < 0)
+        error("server: error setting SO_REUSEPORT.\n");
+    
+    
+    // binding listening socket
+    if (bind(*list_s, (struct sockaddr *) &listaddr, sizeof(listaddr)) < 0)
+        error("server: error during bind.\n");
+        
+    
+    // make the server listening
+    if (listen(*list_s, backlog) < 0)
+        error("server: error during listen.\n");
+}
+
+
+
+
+// binds the port once without SO_REUSEPORT: it fails if another
+// server, even of the same user, is listening on it
+void check_port_free(long port){
+    struct sockaddr_in listaddr;
+    int probe_s;
+    int optval = 1;
+    
+    if((probe_s = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        error("server: error creating socket.\n");
+    
+    memset(&listaddr, 0, sizeof(listaddr));
+    listaddr.sin_family = AF_INET;
+    listaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    listaddr.sin_port = htons(port);
+    
+    // the connections of an earlier run left in TIME_WAIT don't count
+    setsockopt(probe_s, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+    
+    if(bind(probe_s, (struct sockaddr *) &listaddr, sizeof(listaddr)) < 0)
+        error("server: error during bind, the port is in use.\n");
+    
+    close(probe_s);
+}
+
+
+
+
+void check_config_files(){
+    char seats_file[SHOW_FILE_NAME_SIZE];
+    char booking_file[SHOW_FILE_NAME_SIZE];
+    
+    // if one of this files does not exists, then all the existing ones must be deleted
+    if(access(SEATS_FILE_NAME, F_OK) || access(BOOKING_FILE_NAME, F_OK) || access(ACCOUNTS_FILE_NAME, F_OK)){
+        if(!access(SEATS_FILE_NAME, F_OK))
+            unlink(BOOKING_FILE_NAME);
+        
+    
+        if(!access(BOOKING_FILE_NAME, F_OK))
+            unlink(BOOKING_FILE_NAME);
+        
+        
+        if(!access(ACCOUNTS_FILE_NAME, F_OK))
+            unlink(ACCOUNTS_FILE_NAME);
+        
+        
+        // the bookings of the other shows belonged to the deleted accounts,
+        // their seats would stay taken without a code to cancel them
+        for(int i=1; i<MAX_SHOWS; i++){
+            snprintf(seats_file, SHOW_FILE_NAME_SIZE, "%s_%d", SEATS_FILE_NAME, i);
+            snprintf(booking_file, SHOW_FILE_NAME_SIZE, "%s_%d", BOOKING_FILE_NAME, i);
+            unlink(seats_file);
+            unlink(booking_file);
+        }
+    }
+    
+    // a show missing one of its files starts over
+    for(int i=1; i<shows_count; i++){
+        snprintf(seats_file, SHOW_FILE_NAME_SIZE, "%s_%d", SEATS_FILE_NAME, i);
+        snprintf(booking_file, SHOW_FILE_NAME_SIZE, "%s_%d", BOOKING_FILE_NAME, i);
+        
+        if(access(seats_file, F_OK) || access(booking_file, F_OK)){
+            unlink(seats_file);
+            unlink(booking_file);
+        }
+    }
+}
+
+
+
+
+uint64_t *create_struct_file(show_t *show){
+    int fd;                                     // file descriptor of "cinema_struct" file
+    int file_len;                               // the len of file
+    char *buff;                                 // temporary buffer
+    char *row;                                  // seats of a row in the file
+    uint64_t *addr;                             // seats bitset
+    
+    
+    
+    // exclusive creation of file
+    if((fd = open(show->seats_file, O_CREAT|O_EXCL|O_RDWR, 0666)) == -1){        
+        // retry the file opening without exclusive creation
+        if((fd = open(show->seats_file, O_RDWR, 0666)) == -1)
+            error("server: seats file opening failed.");
+        
+    } else {
+        if(shows_count > 1)
+            printf("\nHall of show %d", show->number + 1);
+        
+        // if the just is just created we need
+        // to fill it with some information
+        startup_seats_file(fd);
+    }
+    
+    
+    // retrieving the length of file
+    file_len = lseek(fd, 0, SEEK_END);
+    lseek(fd, 0, SEEK_SET);
+    
+    
+    if((buff = malloc(file_len)) == NULL)
+        error("server: dynamic memory allocation failed.");
+        
+    
+    // reading the "cinema_struct" file
+    if(read(fd, buff, file_len) == -1)
+        error("server: error during file reading.\n");
+    
+    
+    // reading file infos
+    show->n = atoi(strtok(buff, ";"));
+    show->m = atoi(strtok(NULL, ";"));
+    
+    if(!show->n || !show->m)
+        error("server: integer conversion failed.");
+    
+    show->row_words = (show->m + 63) / 64;
+    
+    // on its own cache lines, the bookings write it
+    if((addr = aligned_alloc(64, (show->n * show->row_words * sizeof(uint64_t) + 63) / 64 * 64)) == NULL || (show->row_free = malloc(show->n * sizeof(int))) == NULL)
+        error("server: memory allocation failed.");
+    
+    memset(addr, 0, show->n * show->row_words * sizeof(uint64_t));
+    show->hall_free = 0;
+    
+    
+#ifdef DEBUG
+    printf("%d, %d\n", show->n, show->m);
+    fflush(stdout);
+    printf("addr: %p\n", (void *) addr);
+    fflush(stdout);
+#endif
+    
+    // a bit for each '1' of the file
+    for(int i=0; i<show->n; i++){
+        row = strtok(NULL, ";");
+        show->row_free[i] = show->m;
+        
+        for(int j=0; j<show->m && row != NULL && row[j] != '\0'; j++){
+            if(row[j] == '1'){
+                addr[i * show->row_words + j / 64] |= 1ULL << j % 64;
+                show->row_free[i]--;
+            }
+        }
+        
+        show->hall_free += show->row_free[i];
+    }
+    
+    free(buff);
+    close(fd);
+    
+    return addr;
+}
+
+
+
+
+uint64_t *seat_word(show_t *show, int seat){
+    return &show->cinema[seat / show->m * show->row_words + seat % show->m / 64];
+}
+
+
+
+
+uint64_t seat_bit(show_t *show, int seat){
+    return 1ULL << seat % show->m % 64;
+}
+
+
+
+
+// picks the seats from the rows closest to the middle of the range, skipping
+// the rows without enough free seats by their counters, or without a run
+// long enough by their longest one when the seats are adjacent: these
+// are the run closest to the middle of the row, the others are taken from
+// the runs left to right; false if there aren't so many free
+bool pick_best_seats(show_t *show, int count, bool adjacent, int first_row, int last_row, int *seats){
+    int middle = (first_row + last_row) / 2;
+    int wanted = (show->m - count) / 2;                   // first column of the seats in the middle of a row
+    int picked = 0;
+    int row, start, len, pos, best, best_distance;
+    
+    if(__atomic_load_n(&show->hall_free, __ATOMIC_ACQUIRE) < count)
+        return false;
+    
+    // middle, middle + 1, middle - 1, middle + 2...
+    for(int k=0; k < 2 * (last_row - first_row + 1); k++){
+        row = k % 2 ? middle + (k + 1) / 2 : middle - k / 2;
+        
+        if(row < first_row || row > last_row || __atomic_load_n(&show->row_free[row], __ATOMIC_RELAXED) < (adjacent ? count : 1))
+            continue;
+        
+        if(adjacent && __atomic_load_n(&show->stripes[row].max_run, __ATOMIC_RELAXED) < count)
+            continue;
+        
+        best = -1;
+        best_distance = show->m;
+        
+        for(start = next_free_run(show, row, 0, &len); start != -1; start = next_free_run(show, row, start + len, &len)){
+            if(!adjacent){
+                for(int j=0; j<len && picked<count; j++)
+                    seats[picked++] = row * show->m + start + j + 1;
+                
+                if(picked == count)
+                    return true;
+                continue;
+            }
+            
+            if(len < count)
+                continue;
+            
+            pos = wanted < start ? start : wanted > start + len - count ? start + len - count : wanted;
+            
+            if(abs(pos - wanted) < best_distance){
+                best = pos;
+                best_distance = abs(pos - wanted);
+            }
+        }
+        
+        if(best != -1){
+            for(int j=0; j<count; j++)
+                seats[j] = row * show->m + best + j + 1;
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+
+
+
+// the first run of free seats of the row from column from on, by scanning
+// the bitset a word at a time; its length in len, -1 if there is none
+int next_free_run(show_t *show, int row, int from, int *len){
+    int w = from / 64;
+    uint64_t bits;
+    int start;
+    
+    if(from >= show->m)
+        return -1;
+    
+    for(bits = ~row_word(show, row, w) & ~0ULL << from % 64; bits == 0; bits = ~row_word(show, row, w)){
+        if(++w == show->row_words)
+            return -1;
+    }
+    
+    start = w * 64 + __builtin_ctzll(bits);
+    
+    // the run ends at the next taken seat, or at the row's end
+    for(bits = row_word(show, row, w) & ~0ULL << start % 64; bits == 0; bits = row_word(show, row, w)){
+        if(++w == show->row_words){
+            *len = show->m - start;
+            return start;
+        }
+    }
+    
+    *len = w * 64 + __builtin_ctzll(bits) - start;
+    return start;
+}
+
+
+
+
+// a word of the row's seats, the columns past the row's end look taken
+uint64_t row_word(show_t *show, int row, int w){
+    uint64_t word = __atomic_load_n(&show->cinema[row * show->row_words + w], __ATOMIC_RELAXED);
+    
+    if(w == show->row_words - 1 && show->m % 64 != 0)
+        word |= ~0ULL << show->m % 64;
+    
+    return word;
+}
+
+
+
+
+// keeps the free seats of the rows and of the hall, the seats being booked
+// (delta -1) or released (delta 1)
+void count_seats(show_t *show, const int *seats_array, int bookings, int delta){
+    for(int i=0; i<bookings; i++)
+        __atomic_fetch_add(&show->row_free[(seats_array[i] - 1) / show->m], delta, __ATOMIC_RELAXED);
+    
+    __atomic_fetch_add(&show->hall_free, bookings * delta, __ATOMIC_RELEASE);
+    
+    update_runs(show, seats_array, bookings);
+}
+
+
+
+
+// measures again the longest runs of the rows of the seats, from their bits:
+// each measure starts after the flips that asked for it, under the row's
+// mutex, so the last one of a row has them all
+void update_runs(show_t *show, const int *seats_array, int bookings){
+    int row, last = -1;
+    
+    for(int i=0; i<bookings; i++){
+        row = (seats_array[i] - 1) / show->m;
+        
+        // the seats of a booking come mostly row after row
+        if(row == last)
+            continue;
+        last = row;
+        
+        pthread_mutex_lock(&show->stripes[row].mutex);
+        __atomic_store_n(&show->stripes[row].max_run, longest_free_run(show, row), __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&show->stripes[row].mutex);
+    }
+}
+
+
+
+
+int longest_free_run(show_t *show, int row){
+    int start, len, longest = 0;
+    
+    for(start = next_free_run(show, row, 0, &len); start != -1; start = next_free_run(show, row, start + len, &len)){
+        if(len > longest)
+            longest = len;
+    }
+    
+    return longest;
+}
+
+
+
+
+char *create_booking_file(show_t *show){
+    int fd;
+    int counter = 0;
+    char *addr;
+    size_t size = CODE_SIZE + 2;
+    char *buff; // +2 includes '\n' and '\0'
+    FILE *file;
+    
+    
+    if((buff = malloc(sizeof(char) * size)) == NULL)
+        error("server: memory allocation failed");
+    
+    
+    // exclusive creation of file
+    if((fd = open(show->booking_file, O_CREAT|O_EXCL|O_RDWR, 0666)) == -1){
+        // retry the file opening without exclusive creation
+        if((fd = open(show->booking_file, O_RDWR, 0666)) == -1)
+            error("server: seats file opening failed.");
+    }
+    
+    // creating the shared memory mapping
+    if((addr = (char *) mmap(NULL, show->n * show->m * CODE_SIZE * sizeof(char), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, 0, 0)) == MAP_FAILED)
+        error("server: memory mapping failed.");
+    
+    
+    if ((file = fdopen(fd, "w+")) == NULL)
+        error("server: error while conversion from file descriptor to FILE *");
+    
+    while(getline(&buff, &size, file) > 0){
+        if(buff[0] != '\n'){
+            memcpy(addr + CODE_SIZE * counter, buff, CODE_SIZE);
+        }
+        counter++;
+    }
+    
+    
+    close(fd);
+    fclose(file);
+    free(buff);
+    
     return addr;
 }
 
@@ -601,517 +3948,571 @@ void startup_seats_file(int fd){
 
 
 
-void receive0(){
-    char *buff;
+// checks the bounds of the whole choice and that no seat is repeated:
+// the seats are sorted, so the cost is the booking's, not the hall's
+bool check_seats(show_t *show, int *seats_array, int bookings){
+    qsort(seats_array, bookings, sizeof(int), compare_seats);
+    
+    if(seats_array[0] < 1 || seats_array[bookings - 1] > show->n * show->m)
+        return false;
+    
+    for(int i=1; i<bookings; i++){
+        if(seats_array[i] == seats_array[i - 1])
+            return false;
+    }
+    
+    return true;
+}
+
+
+
+
+int compare_seats(const void *a, const void *b){
+    int x = *(const int *) a;
+    int y = *(const int *) b;
     
-    if((buff = malloc(sizeof(char) * CODE_SIZE)) == NULL)
-        error("memory allocation failed");
+    return (x > y) - (x < y);
+}
+
+
+
+
+// checks the seats and books them, the stripes of their rows being held
+bool book_locked_seats(show_t *show, int *seats_array, int bookings){
+    bool bookable = true;
     
-    redo608:
-    // reading the code from the client
-    if((read(conn_s, buff, CODE_SIZE)) == -1){                                     // read 0.1
-        if(errno != EINTR){
-            error("read 0.1 failed");
-        }else 
-            goto redo608;
+    for (int i = 0; i < bookings && bookable; i++) {
+        if (*seat_word(show, seats_array[i] - 1) & seat_bit(show, seats_array[i] - 1)) {
+            bookable = false;
+#ifdef DEBUG
+            printf("joined in round %d\n", i);
+            fflush(stdout);
+#endif
+        }
     }
     
 #ifdef DEBUG
-    printf("read %s\n", buff);
-    fflush(stdout);
+    puts("starting sleep");
+    sleep(2);
 #endif
     
-    if(remove_booking(buff) == true){
-        // writing the answer to the server
-        if((write(conn_s, "1", sizeof(char))) == -1)                                      // write 0.2
-            error("write 0.2 failed");
-        
-    } else{
-        // writing the answer to the server
-        if((write(conn_s, "0", sizeof(char))) == -1)                                      // write 0.2
-            error("write 0.2 failed");
+    if(bookable){
+        begin_map_write(show);
+        for (int i = 0; i < bookings; i++)
+            __atomic_fetch_or(seat_word(show, seats_array[i] - 1), seat_bit(show, seats_array[i] - 1), __ATOMIC_RELEASE);
+        count_seats(show, seats_array, bookings, -1);
+        end_map_write(show, seats_array, bookings, true);
     }
     
-    free(buff);
+    return bookable;
 }
 
 
 
 
-// sending to the client, the seats availability, row by row
-void send1(){
-    char *buff;
-    ssize_t len;
+// claims every seat setting its bit, undoing the claims on the first
+// conflict: a bit already set is taken, or claimed by another transaction
+bool book_seats_optimistic(show_t *show, int *seats_array, int bookings){
+    // the claims are never seen by the map readers
+    begin_map_write(show);
+    
+    for(int i=0; i<bookings; i++){
+        if(__atomic_fetch_or(seat_word(show, seats_array[i] - 1), seat_bit(show, seats_array[i] - 1), __ATOMIC_ACQUIRE) & seat_bit(show, seats_array[i] - 1)){
+#ifdef DEBUG
+            printf("conflict on seat %d, rolling back %d claims\n", seats_array[i], i);
+            fflush(stdout);
+#endif
+            for(int j=0; j<i; j++)
+                __atomic_fetch_and(seat_word(show, seats_array[j] - 1), ~seat_bit(show, seats_array[j] - 1), __ATOMIC_RELEASE);
+            
+            // the claims may have been measured as taken meanwhile
+            update_runs(show, seats_array, i);
+            
+            end_map_write(show, NULL, 0, false);
+            return false;
+        }
+    }
     
+    count_seats(show, seats_array, bookings, -1);
+    end_map_write(show, seats_array, bookings, true);
     
-    // an integer lenght is 10 at most, and
-    // 11th is for the snprintf's '\0'
-    len = 11;
+    return true;
+}
+
+
+
+
+void fill_bookings(show_t *show, int *seats_array, int bookings, char *code){
+    booking_t *booking;
+    size_t bucket;
     
-    if((buff = malloc(len * sizeof(char))) == NULL)
-        error("server: memory allocation failed");
+    for(int i=0; i<bookings; i++){
+        strncpy(show->booking_addr + (seats_array[i] - 1) * CODE_SIZE * sizeof(char), code, CODE_SIZE * sizeof(char));
+    }
     
+    if((booking = malloc(sizeof(booking_t))) == NULL || (booking->seats = malloc(bookings * sizeof(int))) == NULL)
+        error("server: memory allocation failed");
     
+    memcpy(booking->code, code, CODE_SIZE);
+    memcpy(booking->seats, seats_array, bookings * sizeof(int));
+    booking->count = bookings;
     
-    snprintf(buff, len * sizeof(char), "%d", n);
+    bucket = hash_code(code) & (show->booking_index_size - 1);
     
-    // sends # rows to the client
-    if((write(conn_s, buff, (len - 1) * sizeof(char))) == -1)                                   // write 1
-        error("server: write 1 failed");
+    pthread_rwlock_wrlock(&show->booking_index_lock);
+    booking->next = show->booking_index[bucket];
+    show->booking_index[bucket] = booking;
+    pthread_rwlock_unlock(&show->booking_index_lock);
+}
+
+
+
+
+// the index of the code's show only is locked, the other shows
+// go on booking meanwhile
+bool remove_booking(char *code){
+    booking_t *booking;
+    show_t *show;
+    int number;
     
+    wait_for_token(DELETING_CRITICAL_SECTION_INDEX);
+    number = delete_booking(code);
+    release_token(DELETING_CRITICAL_SECTION_INDEX);
     
+    if(number == -1)
+        return false;
     
-    snprintf(buff, len * sizeof(char), "%d", m);
+    show = &shows[number];
     
-    // sends # cols to the client
-    if((write(conn_s, buff, (len - 1) * sizeof(char))) == -1)                                   // write 2
-        error("server: write 2 failed");
+    pthread_rwlock_wrlock(&show->booking_index_lock);
+    booking = unindex_booking(show, code);
+    pthread_rwlock_unlock(&show->booking_index_lock);
     
+    if(booking != NULL){
+        begin_map_write(show);
+        
+        for(int i = 0; i < booking->count; i++){
+            memset(show->booking_addr + ((booking->seats[i] - 1) * CODE_SIZE), 0, CODE_SIZE);
+            __atomic_fetch_and(seat_word(show, booking->seats[i] - 1), ~seat_bit(show, booking->seats[i] - 1), __ATOMIC_RELEASE);
+        }
+        
+        count_seats(show, booking->seats, booking->count, 1);
+        end_map_write(show, booking->seats, booking->count, false);
+        
+        free(booking->seats);
+        free(booking);
+    }
     
-    free(buff);
+    return true;
 }
 
 
-void send_seats_map(){
-    char *tmp;
-    bool cinema_full = true;
+
+
+// builds the index of the codes from the bookings file, one pass to
+// count the seats of each code and one to fill them in
+void startup_booking_index(show_t *show){
+    booking_t *booking;
+    char *code;
+    size_t bucket;
+    
+    for(show->booking_index_size = 1; show->booking_index_size < (size_t) show->n * show->m; show->booking_index_size *= 2);
+    
+    if((show->booking_index = calloc(show->booking_index_size, sizeof(booking_t *))) == NULL)
+        error("server: memory allocation failed");
+    
+    for(int i=0; i<show->n*show->m; i++){
+        code = show->booking_addr + i * CODE_SIZE;
         
-    // sends a seats row to the client
-    for(int i=0; i<n; i++){
+        if(code[0] == '\0')
+            continue;
         
-        tmp = cinema + i * m * sizeof(char);
+        if((booking = find_booking(show, code)) == NULL){
+            if((booking = malloc(sizeof(booking_t))) == NULL)
+                error("server: memory allocation failed");
+            
+            memcpy(booking->code, code, CODE_SIZE);
+            booking->count = 0;
+            
+            bucket = hash_code(code) & (show->booking_index_size - 1);
+            booking->next = show->booking_index[bucket];
+            show->booking_index[bucket] = booking;
+        }
         
-        if(write(conn_s, tmp, m * sizeof(char)) == -1)  // write 3
-            error("server: write 3 failed");
+        booking->count++;
+    }
+    
+    for(size_t i=0; i<show->booking_index_size; i++){
+        for(booking = show->booking_index[i]; booking != NULL; booking = booking->next){
+            if((booking->seats = malloc(booking->count * sizeof(int))) == NULL)
+                error("server: memory allocation failed");
+            booking->count = 0;
+        }
+    }
+    
+    for(int i=0; i<show->n*show->m; i++){
+        code = show->booking_addr + i * CODE_SIZE;
         
-        for(int j=0; j<m && cinema_full; j++){
-            if(tmp[j] == '0')
-                cinema_full = false;
+        if(code[0] != '\0'){
+            booking = find_booking(show, code);
+            booking->seats[booking->count++] = i + 1;
         }
     }
+}
 
-    if(cinema_full)
-        raise(SIGINT);
+
+
+
+// FNV-1a over the digits, the codes aren't null terminated in the bookings array
+uint64_t hash_code(const char *code){
+    uint64_t hash = 14695981039346656037ULL;
+    
+    for(int i=0; i<CODE_SIZE; i++){
+        hash ^= (unsigned char) code[i];
+        hash *= 1099511628211ULL;
+    }
     
+    return hash;
 }
 
 
-// receiving from client the seats to book
-bool receive2(int **seats_array, int *bookings) {
-    void *status;
-    int res;                                                        // to handle socket message reading
-    char *buff;                                                     // generic buffer to store data
-    int bookable;                                                   // checks the availability of seats
-    ssize_t seat_size = (log10(n * m) + 2) * sizeof(char);          // # max digits for a seat
 
+
+// the number of the ten digits, which aren't null terminated
+uint64_t code_value(const char *code){
+    uint64_t value = 0;
     
+    for(int i=0; i<CODE_SIZE; i++)
+        value = value * 10 + (code[i] - '0');
     
+    return value;
+}
+
+
+
+
+// the booking with the code, the index lock has to be held
+booking_t *find_booking(show_t *show, const char *code){
+    booking_t *curr = show->booking_index[hash_code(code) & (show->booking_index_size - 1)];
     
-#ifdef DEBUG
-    printf("n: %d; m: %d\n", n, m);
-    fflush(stdout);
-#endif
+    while(curr != NULL && memcmp(curr->code, code, CODE_SIZE) != 0)
+        curr = curr->next;
     
+    return curr;
+}
+
+
+
+
+// takes the booking out of the index, whose lock is held exclusively
+booking_t *unindex_booking(show_t *show, const char *code){
+    booking_t **link = &show->booking_index[hash_code(code) & (show->booking_index_size - 1)];
+    booking_t *booking;
     
-    if((buff = malloc(seat_size)) == NULL)
-        error("server: memory allocation failed.");
+    while(*link != NULL && memcmp((*link)->code, code, CODE_SIZE) != 0)
+        link = &(*link)->next;
     
-    do {
-        
-        send_seats_map();
-        
-        
-        // receive from client the number of seats to book
-        res = read(conn_s, buff, seat_size);                                      // read 4
-        
-        redo725:
-        if(res == -1 && errno != EINTR){
-            error("server read 4 failed.");
-        } else if(errno == EINTR){
-            goto redo725;
-        } else if(res == 0)
-            raise(SIGINT);
-        
-        
-        // if buff is '0', close connection -> client doesn't want booking anymore
-        if(buff[0] == '0'){
-            free(buff);
-            close(conn_s);
-            pthread_exit(&status);
-        }
-        
-        
-        if(((*bookings) = atoi(buff)) == 0)
-            error("server: atoi failed.");
-        
-        if((*seats_array = malloc((*bookings) * sizeof(int))) == NULL)
-            error("server: memory allocation faield.");
+    if((booking = *link) != NULL)
+        *link = booking->next;
     
-        
-        
-        
-        
+    return booking;
+}
+
+
+
+
+// hands the stripe off to the first waiter, if any, and wakes the
+// others up so that they can send their new position to the client
+void release_stripe(show_t *show, int row){
+    stripe_t *stripe = &show->stripes[row];
+    stripe_waiter_t *next;
+    struct timespec now;
+    long held_ms;
     
-#ifdef DEBUG
-    printf("bookings: %d\n", *bookings);
-    fflush(stdout);
-#endif
+    pthread_mutex_lock(&stripe->mutex);
     
-        // initializing the bookability to "OK" (true)
-        bookable = 0;
-
-        // reads all the seats wanted and checks if they are bookable
-        for (int i = 0; i < *bookings; i++) {
-            
-            
-            // receiving the seat from client
-            res = read(conn_s, buff, seat_size);                        // read 5 
-            
-            redo768:
-            if(res == -1 && errno != EINTR){        
-                error("error: read 5 failed.");
-            } else if(errno == EINTR){
-                goto redo768;
-            } else if(res == 0)
-                raise(SIGINT);
-            
-            if(((*seats_array)[i] = atoi(buff)) == 0)
-                error("error: integer conversion failed.");
-            
-#ifdef DEBUG
-            printf("\nread 5: %s\n", buff);
-            fflush(stdout);
-            printf("seats_array[%d] = %d\n", i, (*seats_array)[i]);
-            fflush(stdout);
-            printf("memory content %c\n", *(char *)(cinema + ((*seats_array)[i] - 1) * sizeof(char)));
-            fflush(stdout);
-#endif
-        }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    held_ms = (now.tv_sec - stripe->acquired_at.tv_sec) * 1000 + (now.tv_nsec - stripe->acquired_at.tv_nsec) / 1000000;
+    stripe->avg_hold_ms = stripe->served == 0 ? held_ms : (stripe->avg_hold_ms * 7 + held_ms) / 8;
+    
+    if((next = stripe->head) != NULL){
+        stripe->head = next->next;
+        if(stripe->head == NULL)
+            stripe->tail = NULL;
         
+        stripe->served++;
+        stripe->acquired_at = now;
+        next->granted = true;
         
+        for(stripe_waiter_t *curr = next; curr != NULL; curr = curr->next)
+            wake_session(curr->session);
+    } else
+        stripe->busy = false;
     
+    pthread_mutex_unlock(&stripe->mutex);
+}
+
+
+
+
+// seqlock of the seats map: the writers (bookings on different seats,
+// cancellations) don't exclude each other, so they are counted when
+// they start and when they end
+void begin_map_write(show_t *show){
+    __atomic_fetch_add(&show->map_writes_started, 1, __ATOMIC_SEQ_CST);
+}
+
+
 
-        // waiting for the round
-        wait_for_token(BOOKING_CRITICAL_SECTION_INDEX);
-        
-        
-        
-        for (int i = 0; i < *bookings; i++) {
-            if (*(char *)(cinema + ((*seats_array)[i] - 1) * sizeof(char)) != '0') {
-                bookable = 1;
-#ifdef DEBUG
-                printf("joined in round %d\n", i);
-                fflush(stdout);
-#endif
-                continue;
-            }
-        }
-        
-        snprintf(buff, 2 * sizeof(char), "%d", bookable);
-        
-#ifdef DEBUG
-        printf("sending from write 6: %d, %s\n", atoi(buff), buff);
-        fflush(stdout);
-        puts("starting sleep");
-        sleep(2);
-#endif
-        
-        // sending bookable variable
-        if((write(conn_s, buff, 2 * sizeof(char))) == -1)                           // write 6
-            error("server: write 6 failed.");
 
+// the flips of the write, if any, make a new version of the map: they are
+// logged under the version, so the log is in version order
+void end_map_write(show_t *show, const int *seats, int count, bool taken){
+    change_t *change;
+    unsigned long version = 0;
+    
+    if(count > 0){
+        pthread_mutex_lock(&show->change_log_mutex);
         
-        if(bookable != 0){
-            // if seats are not bookable, waiting for the will of retry answer
-            res = read(conn_s, buff, 2 * sizeof(char));                             // read 7
+        for(int i=0; i<count; i++){
+            change = &show->change_log[show->change_log_count++ % CHANGE_LOG_SIZE];
             
-            redo826:
-            if(res == -1 && errno != EINTR){        
-                error("server: read 7 failed.");
-            } else if(errno == EINTR){
-                goto redo826;
-            } else if(res == 0)
-                raise(SIGINT);
-        } else {
-            for (int i = 0; i < *bookings; i++) {
-                cinema[(*seats_array)[i] - 1] = '1';
-            }
+            // the oldest flip is overwritten, its version is no more complete
+            if(show->change_log_count > CHANGE_LOG_SIZE)
+                show->change_log_floor = change->version;
             
-            puts("Input gone well");
+            change->version = show->map_changes + 1;
+            change->seat = seats[i];
+            change->taken = taken;
         }
-
         
-        release_token(BOOKING_CRITICAL_SECTION_INDEX);
+        version = show->map_changes + 1;
+        __atomic_store_n(&show->map_changes, version, __ATOMIC_RELEASE);
         
-    } while (buff[0] == 'y' || buff[0] == 'Y');
+        pthread_mutex_unlock(&show->change_log_mutex);
+    }
+    
+    __atomic_fetch_add(&show->map_writes_done, 1, __ATOMIC_RELEASE);
+    
+    // once the map is stable, for the subscribers falling back to it
+    if(count > 0)
+        publish_changes(show, seats, count, taken, version);
+}
 
+
+
+
+// serializes the flips of a new version once, as a delta frame, and wakes
+// the subscribers up: each loop copies the frame to its own ones; a version
+// published late is left to the coalesced deltas
+void publish_changes(show_t *show, const int *seats, int count, bool taken, unsigned long version){
+    size_t size = FRAME_HEADER_SIZE + 2 * sizeof(uint32_t) + 2 * sizeof(uint64_t) + sizeof(uint32_t) + count * 5;
+    char *end;
     
-#ifdef DEBUG
-    printf("(SEATS) memory area content: ");
-    fflush(stdout);
+    pthread_mutex_lock(&show->subscribers_mutex);
     
-    // stampa del contenuto dell'area di memoria
-    for(int i = 0; i < n * m; i++){
-        printf("%c", cinema[i]);
+    if(show->subscribers == NULL || version < show->push_version){
+        pthread_mutex_unlock(&show->subscribers_mutex);
+        return;
     }
-    puts("");
-    fflush(stdout);
-#endif
     
-    
-    // handling the user answer/the correctness of the input
-    if (buff[0] == 'n' || buff[0] == 'N') {
-        puts("Input canceled");
-        free(buff);
-        return false;
+    // a varint is 5 bytes at most
+    if(size > show->push_size){
+        if((show->push_frame = realloc(show->push_frame, size)) == NULL)
+            error("server: memory allocation failed");
+        show->push_size = size;
     }
-
     
-    free(buff);
-    return true;
+    end = put_u32(put_u64(put_u64(put_u32(put_u32(show->push_frame + FRAME_HEADER_SIZE, show->n), show->m), version - 1), version), count);
+    
+    for(int i=0; i<count; i++)
+        end = put_varint(end, seats[i] * 2 + taken);
+    
+    put_frame_header(show->push_frame, FRAME_MAP_DELTA, end - show->push_frame - FRAME_HEADER_SIZE);
+    show->push_len = end - show->push_frame;
+    show->push_version = version;
+    
+    for(session_t *s = show->subscribers; s != NULL; s = s->sub_next)
+        wake_session(s);
+    
+    pthread_mutex_unlock(&show->subscribers_mutex);
 }
 
 
 
 
-// sending to the client, booking code
-void send3(int *seats_array, int bookings, char *code){
-    fill_bookings(seats_array, bookings, code);
-        
-    printf("code sent to the client: %s\n", code);
-    fflush(stdout);
-    
-    // sends random code to the client
-    if((write(conn_s, code, CODE_SIZE * sizeof(char))) == -1)                                   // write 8
-        error("server: write 8 failed");
-    
-    // add the reservation code to the current account
-    add_reservation_after(current_account->res_head, code);
+unsigned long map_version(show_t *show){
+    return __atomic_load_n(&show->map_changes, __ATOMIC_ACQUIRE);
 }
 
 
 
 
-void fill_bookings(int *seats_array, int bookings, char *code){
-    for(int i=0; i<bookings; i++){
-        strncpy(booking_addr + (seats_array[i] - 1) * CODE_SIZE * sizeof(char), code, CODE_SIZE * sizeof(char));
+// copies the map in dest when no writer is in progress, retrying if one
+// started meanwhile; returns the version of the copy
+unsigned long snapshot_map(show_t *show, char *dest){
+    unsigned long done;
+    unsigned long version;
+    
+    while(1){
+        done = __atomic_load_n(&show->map_writes_done, __ATOMIC_ACQUIRE);
+        
+        if(__atomic_load_n(&show->map_writes_started, __ATOMIC_ACQUIRE) == done){
+            version = map_version(show);
+            
+            for(int i=0; i<show->n; i++){
+                for(int j=0; j<show->m; j++)
+                    dest[i * show->m + j] = __atomic_load_n(&show->cinema[i * show->row_words + j / 64], __ATOMIC_RELAXED) >> j % 64 & 1 ? '1' : '0';
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            
+            if(__atomic_load_n(&show->map_writes_started, __ATOMIC_RELAXED) == done)
+                return version;
+        }
+        
+        sched_yield();
     }
 }
 
 
 
 
-bool remove_booking(char *code){
-    bool result = false;
-    char *buff;
+
+// returns the flips from version since to the current one, given in version;
+// NULL if the log has rotated past since
+change_t *changes_since(show_t *show, unsigned long since, unsigned long *version, int *count){
+    change_t *changes;
+    unsigned long first;
+    unsigned long oldest;
+    
+    pthread_mutex_lock(&show->change_log_mutex);
+    
+    *version = show->map_changes;
+    
+    if(since < show->change_log_floor || since > *version){
+        pthread_mutex_unlock(&show->change_log_mutex);
+        return NULL;
+    }
     
-    if((buff = malloc(sizeof(char) * CODE_SIZE)) == NULL)
-        error("server: memory allocation failed");
+    oldest = show->change_log_count > CHANGE_LOG_SIZE ? show->change_log_count - CHANGE_LOG_SIZE : 0;
     
-    bzero(buff, CODE_SIZE);
+    // going back from the newest flip
+    for(first = show->change_log_count; first > oldest && show->change_log[(first - 1) % CHANGE_LOG_SIZE].version > since; first--);
     
-    wait_for_token(DELETING_CRITICAL_SECTION_INDEX);
-    result = delete_booking(code);
-    release_token(DELETING_CRITICAL_SECTION_INDEX);
+    *count = show->change_log_count - first;
     
+    if((changes = malloc((*count + 1) * sizeof(change_t))) == NULL)
+        error("server: memory allocation failed");
     
-    if(result == true){
-        for(int i = 0; i < n*m; i++){
-            memcpy(buff, booking_addr + (i * CODE_SIZE), CODE_SIZE);
-            
-#ifdef DEBUG
-            printf("buff %s, ", buff);
-            printf("code %s\n", code);
-#endif
-            
-            if(strcmp(buff, code) == 0){
-                memset(booking_addr + (i * CODE_SIZE), 0, CODE_SIZE);
-                
-                cinema[i] = '0';
-            }
-        }
-    }
+    for(int i=0; i<*count; i++)
+        changes[i] = show->change_log[(first + i) % CHANGE_LOG_SIZE];
     
-    return result;
+    pthread_mutex_unlock(&show->change_log_mutex);
+    
+    return changes;
 }
 
 
 
 
+// no signal masking here, to keep an uncontended lock free of syscalls:
+// the termination signals are blocked outside the main thread, and
+// the handlers release the lock looking at in_critical_section
 void wait_for_token(int sem_index){
-    struct sembuf op;
-    op.sem_op = -1;
-    
-    cancel_events();
+    if(sem_index != DELETING_CRITICAL_SECTION_INDEX)
+        error("server: wrong semaphore index.");
     
-    switch(sem_index){
-        case BOOKING_CRITICAL_SECTION_INDEX:        
-            // instantiating sem op structure
-            op.sem_num = sem_index;
-            op.sem_flg = IPC_NOWAIT;
-    
-            redo951:
-            while(semop(semfd, &op, 1) == -1){
-                if(errno != EAGAIN) // on semop failure with IPC_NOWAIT flag
-                    error("server: semaphore operation failed.");
-                
-                // sends the semaphore state to the client
-                if((write(conn_s, "0", sizeof(char))) == -1)                                    // write semaphore state (0)
-                    error("server: write semaphore state (0) failed");
-                
-                sleep(1);
-
-                if(errno == EINTR)
-                    goto redo951;
-            }
-        
-            // sends the semaphore state to the client
-            if((write(conn_s, "1", sizeof(char))) == -1)                                        // write semaphore state (1)
-                error("server: write semaphore state (1) failed");
-            
-            // to better handle signals
-            in_booking_critical_section = true;
-            break;
-            
-            
-        case SIGNUP_CRITICAL_SECTION_INDEX:        
-            // instantiating sem op structure
-            op.sem_num = sem_index;
-            op.sem_flg = 0;
-            
-            redo980:
-            if(semop(semfd, &op, 1) == -1){
-                if(errno != EINTR){
-                    error("server: semaphore operation failed.");
-                }else
-                    goto redo980;
-            }
-            
-            // to better handle signals
-            in_signup_critical_section = true;
-            break;
-            
-            
-        case DELETING_CRITICAL_SECTION_INDEX: 
-            // instantiating sem op structure
-            op.sem_num = 0;
-            op.sem_flg = 0;
-            
-            redo996:
-            if(semop(current_account->semfd, &op, 1) == -1){
-                if(errno != EINTR){
-                    error("server: semaphore operation failed.");
-                } else
-                    goto redo996;
-            }
-            
-            current_account->in_critical_section = true;
-            break;
-            
-        default:
-            error("server: wrong semaphore index.");
-    }
+    pthread_mutex_lock(&current_account->lock);
+    current_account->in_critical_section = true;
 }
 
 
 
 
 void release_token(int sem_index){
-    // instantiating sem op structure
-    struct sembuf op;
-    op.sem_op = 1;
-    op.sem_flg = 0;
+    if(sem_index != DELETING_CRITICAL_SECTION_INDEX)
+        error("server: wrong semaphore index.");
     
-    if(sem_index == DELETING_CRITICAL_SECTION_INDEX){
-        op.sem_num = 0;
-        
-        if(semop(current_account->semfd, &op, 1) == -1)
-            error("server: semaphore operation failed.");
-        
-        current_account->in_critical_section = false;
-        
-    } else {
-        
-        op.sem_num = sem_index;
-        
-        if(semop(semfd, &op, 1) == -1)
-            error("server: semaphore operation failed.");
-        
-        // to better handle signals
-        if(sem_index == BOOKING_CRITICAL_SECTION_INDEX)
-            in_booking_critical_section = true;
-        else
-            in_signup_critical_section = true;
-    }
-    restore_events();
+    current_account->in_critical_section = false;
+    pthread_mutex_unlock(&current_account->lock);
 }
 
 
 
 
-char * get_random_code(){
-    bool ok;                           // flag for handle random code choice
-    int code;
-    char *str_code;
-    char *buff;
+// the codes are the counter values shuffled by the keyed permutation, so
+// they are unique without looking them up; the keys change at every
+// startup, so only the codes of the earlier runs have to be skipped
+void get_random_code(char *code){
+    uint64_t value;
+    bool ok;
     
-    if((str_code = malloc((CODE_SIZE + 1) * sizeof(char))) == NULL)
-        error("server: memory allocation failed")
-    
-    if((buff = malloc((CODE_SIZE + 1) * sizeof(char))) == NULL)
-        error("server: memory allocation failed")
-        
-    // generating random codes without duplicates
     do{
-        ok = true;
-        
-        code = ((int) rand() % (RAND_MAX - 1000000000) + 1000000000); // 1 MLD
-        snprintf(str_code, (CODE_SIZE + 1) * sizeof(char), "%d", code);
+        if(code_next == code_end){
+            code_next = __atomic_fetch_add(&codes_taken, CODE_BLOCK, __ATOMIC_RELAXED);
+            code_end = code_next + CODE_BLOCK;
+        }
         
+        value = 1000000000ULL + permute_code(code_next++);
         
-        for(int i=0; i<n*m; i++){
-            memcpy(buff, booking_addr + i * CODE_SIZE * sizeof(char), CODE_SIZE * sizeof(char));
-            
-            if(strcmp(buff, str_code) == 0){
-                ok = false;
-                break;
-            }
-        }
+        ok = bsearch(&value, earlier_codes, earlier_codes_count, sizeof(uint64_t), compare_codes) == NULL;
     }while(!ok);
     
-    free(buff);
-    
-    return str_code;
+    snprintf(code, (CODE_SIZE + 1) * sizeof(char), "%llu", (unsigned long long) value);
 }
 
 
 
 
-void cancel_events(){
-    int v[7] = {SIGHUP, SIGINT, SIGQUIT, SIGILL, SIGSEGV, SIGPIPE, SIGTERM};
+// the show the code was booked for, NULL if there is none: it
+// looks in every show, only the startup uses it
+show_t *booking_show(const char *code){
+    booking_t *booking = NULL;
+    int i;
     
-    sigset_t set;
-    
-    for(int i=0; i<7; i++)
-        sigaddset(&set, v[i]);
+    for(i=0; booking == NULL && i<shows_count; i++){
+        pthread_rwlock_rdlock(&shows[i].booking_index_lock);
+        booking = find_booking(&shows[i], code);
+        pthread_rwlock_unlock(&shows[i].booking_index_lock);
+    }
     
-    sigprocmask(SIG_BLOCK, &set, NULL);
+    return booking != NULL ? &shows[i - 1] : NULL;
 }
 
 
 
-void restore_events(){
-    int v[7] = {SIGHUP, SIGINT, SIGQUIT, SIGILL, SIGSEGV, SIGPIPE, SIGTERM};
-    
-    sigset_t set;
+
+// bijection of [0, CODE_SPACE): a Feistel network is one on the 34 bits,
+// and walking the cycle until the value falls back in the space keeps it so
+uint64_t permute_code(uint64_t x){
+    const uint64_t mask = (1ULL << CODE_HALF_BITS) - 1;
+    uint64_t left, right, mixed;
     
-    for(int i=0; i<7; i++)
-        sigaddset(&set, v[i]);
+    do{
+        left = x >> CODE_HALF_BITS;
+        right = x & mask;
+        
+        for(int i=0; i<CODE_ROUNDS; i++){
+            // splitmix64 finalizer as round function
+            mixed = right ^ code_keys[i];
+            mixed = (mixed ^ (mixed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            mixed = (mixed ^ (mixed >> 27)) * 0x94d049bb133111ebULL;
+            mixed ^= mixed >> 31;
+            
+            mixed = left ^ (mixed & mask);
+            left = right;
+            right = mixed;
+        }
+        
+        x = left << CODE_HALF_BITS | right;
+    }while(x >= CODE_SPACE);
     
-    sigprocmask(SIG_UNBLOCK, &set, NULL);
+    return x;
 }
 
 
+
+
 void setup_events(){
     
     sigset_t set;
@@ -1149,53 +4550,54 @@ void setup_events(){
 
 
 // stores the state of the cinema in the file "cinema_struct"
-void sync_cinema_file(){
+void sync_cinema_file(show_t *show){
     int     fd;
     size_t  size;
     char    *initial_infos;
+    char    *snapshot;
 
 
-    if((fd = open(SEATS_FILE_NAME, O_WRONLY|O_TRUNC, 0666)) == -1)                     // file opened is trunced because is going to be rewritten
+    if((fd = open(show->seats_file, O_WRONLY|O_TRUNC, 0666)) == -1)                     // file opened is trunced because is going to be rewritten
         error("server: seats file opening failed.");
 
-    size = sizeof(char) * (floor(log10(n)) + 1 + floor(log10(m)) + 1 + 3);             // copied from create struct file, the ending + 1 is for the \n
+    size = sizeof(char) * (floor(log10(show->n)) + 1 + floor(log10(show->m)) + 1 + 3);             // copied from create struct file, the ending + 1 is for the \n
     if((initial_infos = malloc(size)) == NULL)
         error("server: memory allocation failed.");
 
-    snprintf(initial_infos, size, "%d;%d;", n, m);                                     // sizeof(char) is for the \n
+    snprintf(initial_infos, size, "%d;%d;", show->n, show->m);                                     // sizeof(char) is for the \n
     write(fd, initial_infos, size - sizeof(char));
 
 
-    for(int i = 0; i < n; i++){                                    // cycling rows
-        for(int j = 0; j < m; j ++){                               // cycling cols
-            if(cinema[m * i + j] == '1')
-                write(fd, "1", sizeof(char));
-            else if(cinema[m * i + j] == '0')
-                write(fd, "0", sizeof(char));
-            else
-                error("cinema struct memory corrupted");
-        }
+    // the seats claimed by an unfinished optimistic transaction are still free
+    if((snapshot = malloc(show->n * show->m * sizeof(char))) == NULL)
+        error("server: memory allocation failed.");
+    
+    snapshot_map(show, snapshot);
+
+    for(int i = 0; i < show->n; i++){                                    // cycling rows
+        write(fd, snapshot + i * show->m, show->m * sizeof(char));
         write(fd, ";", sizeof(char));
     }
 
     close(fd);
     
     free(initial_infos);
+    free(snapshot);
 }
 
 
 
 // stores the bookings done until that moment in the file "booking_struct"
-void sync_prenotazioni_file(){
+void sync_prenotazioni_file(show_t *show){
     int fd;
     char arr[10];
     
-    if((fd = open(BOOKING_FILE_NAME, O_WRONLY|O_TRUNC, 0666)) == -1)     // file opened is truncated because is going to be rewritten
+    if((fd = open(show->booking_file, O_WRONLY|O_TRUNC, 0666)) == -1)     // file opened is truncated because is going to be rewritten
         error("server: seats file opening failed.");
     
     
-    for(int i = 0; i < n * m; i++){
-        memcpy(arr, &booking_addr[i * CODE_SIZE], sizeof(char) * CODE_SIZE);
+    for(int i = 0; i < show->n * show->m; i++){
+        memcpy(arr, &show->booking_addr[i * CODE_SIZE], sizeof(char) * CODE_SIZE);
         
 #ifdef DEBUG
         printf("%10s\n", arr);
@@ -1220,7 +4622,8 @@ void sync_accounts_file(){
     int fd;
     char *buff;
     size_t main_info_size;
-    reservation_t *curr_res;
+    person_t *account;
+    bool first = true;
     char semi_colons;
     char new_line;
     
@@ -1234,34 +4637,27 @@ void sync_accounts_file(){
     if((buff = malloc(MAX_ACCOUNT_LINE_SIZE * sizeof(char))) == NULL)
         error("server: memory allocation failed");
     
-    accounts = accounts->next;
-    
-    while(accounts != NULL){
-        main_info_size = (strlen(accounts->nickname) + strlen(accounts->email) + strlen(accounts->psw) + 3) * sizeof(char);
-        
-        snprintf(buff, main_info_size, "%s;%s;%s", accounts->nickname, accounts->email, accounts->psw);
-        
-        curr_res = accounts->res_head->next;
-        
-        while(curr_res){
-            strncat(buff, &semi_colons, sizeof(char));
-            strncat(buff, curr_res->code, CODE_SIZE * sizeof(char));
-            
-            main_info_size += (CODE_SIZE + 1) * sizeof(char);
-            
-            curr_res = curr_res->next;
+    for(int i=0; i<ACCOUNT_SHARDS; i++){
+        for(size_t j=0; j<account_shards[i].size; j++){
+            for(account = account_shards[i].buckets[j]; account != NULL; account = account->next){
+                main_info_size = (strlen(account->nickname) + strlen(account->email) + strlen(account->psw) + 3) * sizeof(char);
+                
+                snprintf(buff, main_info_size, "%s;%s;%s", account->nickname, account->email, account->psw);
+                
+                // because our file is formatted in a way that the
+                // last line doesn't contain '\n'
+                if(!first)
+                    write(fd, &new_line, sizeof(char));
+                
+                write(fd, buff, main_info_size - sizeof(char));
+                first = false;
+                
+                for(int k=0; k<account->codes_count; k++){
+                    write(fd, &semi_colons, sizeof(char));
+                    write(fd, account->codes[k].code, CODE_SIZE * sizeof(char));
+                }
+            }
         }
-        
-        // because our file is formatted in a way that the
-        // last line doesn't contain '\n'
-        if(accounts->next != NULL){
-            strncat(buff, &new_line, sizeof(char));
-            
-            write(fd, buff, main_info_size);
-        } else
-            write(fd, buff, main_info_size - sizeof(char));
-        
-        accounts = accounts->next;
     }
     
     free(buff);
@@ -1269,227 +4665,253 @@ void sync_accounts_file(){
 
 
 
-long get_port(int argc, char *argv[]){
-    long port;
+long get_options(int argc, char *argv[]){
+    long port = DEFAULT_PORT;
     char *endptr;
+    int opt;
     
-    switch(argc){
-        case 1:
-            port = DEFAULT_PORT;
-            break;
-            
-        case 3:
-            if(strcmp(argv[1], "-p") == 0){
+    while((opt = getopt(argc, argv, "p:e:m:l:w:a:b:s:")) != -1){
+        switch(opt){
+            case 'p':
                 errno = 0; // reset error number
-                port = strtol(argv[2], &endptr, 10);
+                port = strtol(optarg, &endptr, 10);
                 
                 if(errno == ERANGE ||                       // number is too small or too large
-                    endptr == argv[2] ||                    // no character was read
+                    endptr == optarg ||                     // no character was read
                     (*endptr && *endptr != '\n') ||         // *endptr is neither end of string nor newline, so we didn't convert the *whole* input
                     port < 1024 || port > 65535){           // port must be ephemeral or non-privileged
                     
-                    error("USAGE: ./server [-p <PORT_NUMBER>], port number must be ephemeral or non-privileged");
+                    error(SERVER_USAGE ", port number must be ephemeral or non-privileged");
                 }
-            }
-            else error("USAGE: ./server [-p <PORT_NUMBER>]");
-            break;
-            
-        default:
-            error("USAGE: ./server [-p <PORT_NUMBER>]");
-            break;
+                break;
+                
+            case 'e':
+                if(strcmp(optarg, "locking") == 0)
+                    booking_engine = BOOKING_ENGINE_LOCKING;
+                else if(strcmp(optarg, "optimistic") == 0)
+                    booking_engine = BOOKING_ENGINE_OPTIMISTIC;
+                else
+                    error(SERVER_USAGE ", unknown booking engine");
+                break;
+                
+            case 'm':
+                if(strcmp(optarg, "threads") == 0)
+                    server_mode = SERVER_MODE_THREADS;
+                else if(strcmp(optarg, "epoll") == 0)
+                    server_mode = SERVER_MODE_EPOLL;
+                else if(strcmp(optarg, "uring") == 0)
+                    server_mode = SERVER_MODE_URING;
+                else
+                    error(SERVER_USAGE ", unknown server mode");
+                break;
+                
+            case 'l':
+                if((event_loops_count = parse_long_option(optarg, 1, MAX_EVENT_LOOPS)) == -1)
+                    error(SERVER_USAGE ", wrong number of event loops");
+                break;
+                
+            case 'w':
+                if((workers_count = parse_long_option(optarg, 1, MAX_WORKERS)) == -1)
+                    error(SERVER_USAGE ", wrong number of workers");
+                break;
+                
+            case 'a':
+                if((listeners_count = parse_long_option(optarg, 1, MAX_LISTENERS)) == -1)
+                    error(SERVER_USAGE ", wrong number of listeners");
+                break;
+                
+            case 'b':
+                if((backlog = parse_long_option(optarg, 1, MAX_BACKLOG)) == -1)
+                    error(SERVER_USAGE ", wrong backlog");
+                break;
+                
+            case 's':
+                if((shows_count = parse_long_option(optarg, 1, MAX_SHOWS)) == -1)
+                    error(SERVER_USAGE ", wrong number of shows");
+                break;
+                
+            default:
+                error(SERVER_USAGE);
+                break;
+        }
     }
     
+    if(optind < argc)
+        error(SERVER_USAGE);
+    
     return port;
 }
 
 
 
-void *add_person_after(person_t *prev, char *nickname, char *email, char *psw, reservation_t *reserv) {
-    person_t *node = malloc(sizeof(*node));
+// returns the value of a numeric option, -1 if it is not a number in [min, max]
+long parse_long_option(char *arg, long min, long max){
+    long value;
+    char *endptr;
+    
+    errno = 0; // reset error number
+    value = strtol(arg, &endptr, 10);
+    
+    if(errno == ERANGE || endptr == arg || *endptr || value < min || value > max)
+        return -1;
+    
+    return value;
+}
 
-    if(!node)
-        return NULL;
 
-    node->email = email;
-    node->nickname = nickname;
-    node->psw = psw;
+
+// adds the account unless its email is taken: the check and the insertion
+// are made under the shard's lock, so two signups with the same email can't
+// both succeed; NULL if the email is taken. The strings are copied in the
+// shard's arena, with room for codes_size codes
+person_t *add_account(const char *nickname, const char *email, const char *psw, int codes_size){
+    uint64_t hash = hash_email(email);
+    account_shard_t *shard = &account_shards[hash & (ACCOUNT_SHARDS - 1)];
+    person_t **bucket;
+    person_t *node;
+    
+    pthread_rwlock_wrlock(&shard->lock);
+    
+    if(find_account(shard, hash, email) != NULL){
+        pthread_rwlock_unlock(&shard->lock);
+        return NULL;
+    }
+    
+    node = arena_alloc(&shard->arena, sizeof(*node), _Alignof(person_t));
+    
+    node->email = arena_strdup(&shard->arena, email);
+    node->nickname = arena_strdup(&shard->arena, nickname);
+    node->psw = arena_strdup(&shard->arena, psw);
+    node->hash = hash;
     node->in_critical_section = false;
-    node->res_head = reserv;
+    node->codes_count = 0;
+    node->codes_size = codes_size;
+    node->codes = NULL;
     
+    if(codes_size > 0 && (node->codes = malloc(codes_size * sizeof(account_code_t))) == NULL)
+        error("server: memory allocation failed");
     
-    if((node->semfd = semget(IPC_PRIVATE, 1, IPC_CREAT | IPC_EXCL | 0666)) == -1)
-        error("server: semaphore creation failed");
+    // in-process lock: the accounts are limited only by memory, not by SEMMNI
+    pthread_mutex_init(&node->lock, NULL);
     
-    if(semctl(node->semfd, 0, SETVAL, 1) == -1)
-        error("server: semaphore control operation failed");
+    if(shard->count == shard->size)
+        grow_shard(shard);
     
+    bucket = &shard->buckets[hash / ACCOUNT_SHARDS & (shard->size - 1)];
+    node->next = *bucket;
+    *bucket = node;
+    shard->count++;
     
+    pthread_rwlock_unlock(&shard->lock);
     
-    node->next = prev->next;
-    prev->next = node;
-
     return node;
 }
 
 
 
-void *add_reservation_after(reservation_t *prev, char *code){
-    reservation_t *node = malloc(sizeof(*node));
+// doubles the buckets of a full shard, whose lock is held exclusively
+void grow_shard(account_shard_t *shard){
+    person_t **buckets;
+    person_t *node, *next;
+    size_t size = shard->size * 2;
     
-    if(!node)
-        return NULL;
-
-    if((node->code = malloc(sizeof(char) * CODE_SIZE)) == NULL)
+    if((buckets = calloc(size, sizeof(person_t *))) == NULL)
         error("server: memory allocation failed");
     
-    memcpy(node->code, code, CODE_SIZE * sizeof(char));
-    node->next = prev->next;
-    prev->next = node;
-
-    return node;
+    for(size_t i=0; i<shard->size; i++){
+        for(node = shard->buckets[i]; node != NULL; node = next){
+            next = node->next;
+            node->next = buckets[node->hash / ACCOUNT_SHARDS & (size - 1)];
+            buckets[node->hash / ACCOUNT_SHARDS & (size - 1)] = node;
+        }
+    }
+    
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->size = size;
 }
 
 
 
-void init_person_list(person_t **head) {
-    *head = malloc(sizeof(**head));
+// FNV-1a: the low bits choose the shard, the others the bucket
+uint64_t hash_email(const char *email){
+    uint64_t hash = 14695981039346656037ULL;
     
-    (*head)->email = "admin";
-    (*head)->nickname = "admin";
-    (*head)->psw = "admin";
+    for(; *email != '\0'; email++){
+        hash ^= (unsigned char) *email;
+        hash *= 1099511628211ULL;
+    }
     
-    (*head)->res_head = NULL;
-    (*head)->next = NULL;
+    return hash;
 }
 
 
 
-void init_reservation_list(reservation_t **head) {
-    *head = malloc(sizeof(**head));
-    (*head)->code = "admin";
-    (*head)->next = NULL;
+// appends the code of a booking for the show to the account's ones, its lock being held
+void add_reservation(person_t *person, const char *code, int show){
+    if(person->codes_count == person->codes_size){
+        person->codes_size = person->codes_size > 0 ? person->codes_size * 2 : 4;
+        
+        if((person->codes = realloc(person->codes, person->codes_size * sizeof(account_code_t))) == NULL)
+            error("server: memory allocation failed");
+    }
+    
+    memcpy(person->codes[person->codes_count].code, code, CODE_SIZE);
+    person->codes[person->codes_count++].show = show;
 }
 
 
 
-void get_user_info(int access_type){
-    char *username;
-    char *email;
-    char *password;
-    int res;
-    bool ok = false;
-    reservation_t *reservation;
-    
-    if((username = malloc(MAX_INPUT_SIZE * sizeof(char))) == NULL)
-        error("server: memory allocation failed");
-    
-    if((email = malloc(MAX_INPUT_SIZE * sizeof(char))) == NULL)
-        error("server: memory allocation failed");
+// the arena's lock has to be held
+void *arena_alloc(arena_t *arena, size_t size, size_t align){
+    size_t start = (arena->used + align - 1) & ~(align - 1);
     
-    if((password = malloc(MAX_INPUT_SIZE * sizeof(char))) == NULL)
-        error("server: memory allocation failed");
+    if(arena->block == NULL || start + size > arena->size){
+        arena->size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        
+        // the old block stays, its records are still in use
+        if((arena->block = malloc(arena->size)) == NULL)
+            error("server: memory allocation failed");
+        
+        start = 0;
+    }
     
+    arena->used = start + size;
     
+    return arena->block + start;
+}
+
+
+
+char *arena_strdup(arena_t *arena, const char *str){
+    size_t len = strlen(str) + 1;
     
-    do{
-#ifdef DEBUG
-        puts("EMAIL");
-#endif
-        redo1392:
-        // EMAIL
-        res = read(conn_s, email, MAX_INPUT_SIZE * sizeof(char));                                     // read -2.1.1
+    return memcpy(arena_alloc(arena, len, 1), str, len);
+}
 
-        if(res == -1 && errno != EINTR){
-            error("read -2.1.1 failed");
-        } else if(errno == EINTR) {
-            goto redo1392;
-        } else if(res == 0)
-            raise(SIGINT);
-        
-        
-        
-        if(access_type == WANT_TO_SIGN_UP){
-#ifdef DEBUG
-            puts("USERNAME");
-#endif
-            redo1409:
-            // USERNAME
-            res = read(conn_s, username, MAX_INPUT_SIZE * sizeof(char));                                     // read -2.1.2
-
-            if(res == -1 && errno != EINTR){
-                error("read -2.1.2 failed");
-            } else if(errno == EINTR) {
-                goto redo1409;
-            } else if(res == 0)
-                raise(SIGINT);
-        } else if(access_type == WANT_TO_SIGN_IN){
-            username = retrieve_username(email);
-        }
-        
-        
-        
-        // PASSWORD
-#ifdef DEBUG
-        puts("PASSWORD");
-#endif
-        redo1429:
-        res = read(conn_s, password, MAX_INPUT_SIZE * sizeof(char));                                     // read -2.1.3
 
-        if(res == -1 && errno != EINTR){
-            error("read -2.1.3 failed");
-        } else if(errno == EINTR) {
-            goto redo1429;
-        } else if(res == 0)
-            raise(SIGINT);
-        
-#ifdef DEBUG
-        printf("access type = WANT_TO_SIGN_UP ? %s\n", access_type == WANT_TO_SIGN_UP ? "SI" : "NO");
-        printf("read -2.1.1 = %s\n", email);
-        printf("read -2.1.2 = %s\n", username);
-        printf("read -2.1.3 = %s\n", password);
-#endif
-        
-        
-        
-        
-        if(access_type == WANT_TO_SIGN_UP){
-//             wait_for_token(SIGNUP_CRITICAL_SECTION_INDEX);
-            if(check_mail_exists(email) == NULL){
-                ok = true;
-                init_reservation_list(&reservation);
-                
-                
-                current_account = add_person_after(accounts, username, email, password, reservation);
-                print_accounts();
-                
-            }
-//             release_token(SIGNUP_CRITICAL_SECTION_INDEX);
-        } else if(access_type == WANT_TO_SIGN_IN){
-            if((current_account = check_account_exists(email, password)) != NULL)
-                ok = true;
-        }
-        
-        
-        // sending the result to the client
-        if((write(conn_s, ok == true ? "1" : "0", sizeof(char))) == -1)                                                // write -2.2
-            error("write -2.2 failed");
-        
+
+void startup_accounts(){
+    for(int i=0; i<ACCOUNT_SHARDS; i++){
+        pthread_rwlock_init(&account_shards[i].lock, NULL);
         
-        if(access_type == WANT_TO_SIGN_IN && ok == true){
-            if((write(conn_s, username, MAX_INPUT_SIZE * sizeof(char))) == -1)                                                // write -2.3
-                error("write -2.3 failed");
-        }
+        if((account_shards[i].buckets = calloc(ACCOUNT_SHARD_BUCKETS, sizeof(person_t *))) == NULL)
+            error("server: memory allocation failed");
         
-    } while(!ok);
+        account_shards[i].size = ACCOUNT_SHARD_BUCKETS;
+        account_shards[i].count = 0;
+        account_shards[i].arena.block = NULL;
+    }
 }
 
 
 
-person_t *check_mail_exists(char *email){
-    person_t *curr = accounts;
+// the account with the email, in the shard whose lock is held
+person_t *find_account(account_shard_t *shard, uint64_t hash, const char *email){
+    person_t *curr = shard->buckets[hash / ACCOUNT_SHARDS & (shard->size - 1)];
     
     while(curr != NULL){
-        if(strcmp(curr->email, email) == 0)
+        if(curr->hash == hash && strcmp(curr->email, email) == 0)
             return curr;
         curr = curr->next;
     }
@@ -1499,74 +4921,46 @@ person_t *check_mail_exists(char *email){
 
 
 
-person_t *check_account_exists(char *email, char *password){
+// the accounts are never removed: the one found stays valid out of the lock
+person_t *check_mail_exists(char *email){
+    uint64_t hash = hash_email(email);
+    account_shard_t *shard = &account_shards[hash & (ACCOUNT_SHARDS - 1)];
     person_t *person;
     
-    if((person = check_mail_exists(email)) == NULL)
-        return NULL;
-    
-    if(strcmp(person->psw, password) == 0)
-        return person;
+    pthread_rwlock_rdlock(&shard->lock);
+    person = find_account(shard, hash, email);
+    pthread_rwlock_unlock(&shard->lock);
     
-    return NULL;
+    return person;
 }
 
 
 
-char *retrieve_username(char *email){
+person_t *check_account_exists(char *email, char *password){
     person_t *person;
     
     if((person = check_mail_exists(email)) == NULL)
         return NULL;
     
-    return person->nickname;
-}
-
-
-
-int user_access(){
-    char *buff;
-    int res;
-    
-    if((buff = malloc(sizeof(char))) == NULL)
-        error("server: memory allocation failed");
-    
-    
-    redo1529:
-    // reading the decision from the client
-    res = read(conn_s, buff, sizeof(char));                                     // read -2
-
-    if(res == -1){
-        error("read -2 failed");
-    } else if(errno == EINTR) {
-        goto redo1529;
-    } else if(res == 0)
-        raise(SIGINT);
-    
+    if(strcmp(person->psw, password) == 0)
+        return person;
     
-    if(*buff == '1'){
-        free(buff);
-        return WANT_TO_SIGN_IN;
-    } else if(*buff == '2') {
-        free(buff);
-        return WANT_TO_SIGN_UP;
-    } else {
-        free(buff);
-        return WANT_TO_EXIT;
-    }
+    return NULL;
 }
 
 
 
-person_t *create_accounts_file(){
+void create_accounts_file(){
     int fd;
     size_t size = MAX_ACCOUNT_LINE_SIZE;
     char *buff;
+    char *nickname, *email, *psw, *codes, *code;
+    int codes_count;
+    show_t *show;
+    person_t *account;
     FILE *file;
     
-    person_t *list = NULL, *p_curr = NULL;
-    
-    init_person_list(&list);    
+    startup_accounts();
     
     if((buff = malloc(sizeof(char) * size)) == NULL)
         error("server: memory allocation failed");
@@ -1584,114 +4978,85 @@ person_t *create_accounts_file(){
     
     
     while(getline(&buff, &size, file) > 0){
+        // the password ends the lines without reservations
+        if((nickname = strtok(buff, ";")) == NULL || (email = strtok(NULL, ";")) == NULL || (psw = strtok(NULL, ";\n")) == NULL)
+            continue;
         
-        reservation_t *sub_list=NULL, *r_curr=NULL;
-        init_reservation_list(&sub_list);
-        
-        
-        char *nickname, *email, *psw;
-        
-        if((nickname = malloc(MAX_INPUT_SIZE)) == NULL || (email = malloc(MAX_INPUT_SIZE)) == NULL || (psw = malloc(MAX_INPUT_SIZE)) == NULL)
-            error("server: memory allocation failed.");
+        // the rest of the line is the codes, each one followed by ';' but the last one
+        codes = strtok(NULL, "\n");
+        codes_count = codes != NULL ? (strlen(codes) + 1) / (CODE_SIZE + 1) : 0;
         
-        memcpy(nickname, strtok(buff, ";"), MAX_INPUT_SIZE);
-        memcpy(email, strtok(NULL, ";"), MAX_INPUT_SIZE);
-        memcpy(psw, strtok(NULL, ";"), MAX_INPUT_SIZE);
+        if((account = add_account(nickname, email, psw, codes_count)) == NULL)
+            continue;
         
-        while(true){
-        
-            char *code;
-            if((code = malloc(CODE_SIZE)) == NULL)
-                error("server: memory allocation failed.");
-                
-            char *a = strtok(NULL, ";");
-            if(a == NULL)
-                break;
-            
-            memcpy(code, a, CODE_SIZE);
-            
-            if(r_curr == NULL)
-                r_curr = add_reservation_after(sub_list, code);
-            else
-                r_curr = add_reservation_after(r_curr, code);
+        // the file keeps only the codes, the shows are looked up once
+        for(int i=0; i<codes_count; i++){
+            code = codes + i * (CODE_SIZE + 1);
+            add_reservation(account, code, (show = booking_show(code)) != NULL ? show->number : 0);
         }
-        
-        
-        if(!p_curr)
-            p_curr = add_person_after(list, nickname, email, psw, sub_list);
-        else
-            p_curr = add_person_after(p_curr, nickname, email, psw, sub_list);
     }
     
     close(fd);
     fclose(file);
     free(buff);
-    
-    return list;
 }
        
 
 
 void print_accounts(){
-    person_t *list = accounts;
-    reservation_t *tmp;
-    
+    person_t *list;
     
-    list = list->next;
-    while(list != NULL){
+    for(int i=0; i<ACCOUNT_SHARDS; i++){
+        pthread_rwlock_rdlock(&account_shards[i].lock);
         
-        printf("persona %s\n", list->nickname);
-        
-        puts("reservations");
-        
-        tmp = list->res_head;
-        while(tmp != NULL){
-            printf(" %s ", tmp->code);
-            tmp = tmp->next;
+        for(size_t j=0; j<account_shards[i].size; j++){
+            for(list = account_shards[i].buckets[j]; list != NULL; list = list->next){
+                
+                printf("persona %s\n", list->nickname);
+                
+                puts("reservations");
+                
+                for(int k=0; k<list->codes_count; k++)
+                    printf(" %.*s ", CODE_SIZE, list->codes[k].code);
+                
+                puts("");
+            }
         }
         
-        puts("");
-        
-        list = list->next;
+        pthread_rwlock_unlock(&account_shards[i].lock);
     }
 }
 
 
 
-reservation_t *retrieve_booking(char *code){
-    reservation_t *curr;
-    
-    curr = current_account->res_head;
-    
-    while(curr){
-        if(strcmp(curr->code, code) == 0)
-            return curr;
-        curr = curr->next;
+// position of the code among the current account's ones, -1 if it isn't there
+int retrieve_booking(char *code){
+    for(int i=0; i<current_account->codes_count; i++){
+        if(memcmp(current_account->codes[i].code, code, CODE_SIZE) == 0)
+            return i;
     }
     
-    return NULL;
+    return -1;
 }
 
 
 
-bool delete_booking(char *code){
-    reservation_t *curr, *deleting;
+// takes the code out of the current account's ones, returning the
+// number of its show; -1 if the account has no such booking
+int delete_booking(char *code){
+    int deleting;
+    int show;
     
-    deleting = retrieve_booking(code);
-    
-    if(deleting == NULL)
-        return false;
-        
-    curr = current_account->res_head;
+    if((deleting = retrieve_booking(code)) == -1)
+        return -1;
     
-    while(strcmp(curr->next->code, code) != 0){
-        curr = curr->next;
-    }
+    show = current_account->codes[deleting].show;
     
-    curr->next = deleting->next;
-    free(deleting);
+    // the others keep their order
+    memmove(&current_account->codes[deleting], &current_account->codes[deleting + 1], (current_account->codes_count - deleting - 1) * sizeof(account_code_t));
+    current_account->codes_count--;
     
-    return true;
+    return show;
 }
 
 
@@ -0,0 +1,203 @@
+#include "test.h"
+
+#define ACCOUNTS_USAGE "USAGE: ./accounts [-p <PORT_NUMBER>] [-a <SERVER_ADDRESS>] [-c <CLIENTS>] [-d <SECONDS>] [-n <ACCOUNTS>] [-g]"
+#define MAX_CLIENTS 1024
+#define STARTUP_WAIT 120                    // seconds the server may take to load its accounts
+
+
+typedef struct client{
+    pthread_t tid;
+    int index;
+    unsigned long done;
+    bool failed;
+} client_t;
+
+
+void *client_func(void *arg);
+bool access_once(client_t *self, unsigned long k);
+double run_phase(bool phase);
+
+
+// global variables
+char *address = "127.0.0.1";
+long port = DEFAULT_PORT;
+int clients_count = 16;
+int seconds = 3;
+long accounts = 1000000;
+bool signing_up;                            // the phase: new accounts or sign ins to the existing ones
+client_t *clients;
+pthread_barrier_t ready;
+volatile bool stop = false;
+
+
+
+
+// the server is started with the accounts written by -g: the clients sign
+// in to random ones of them, then sign up new ones, each access on a
+// connection of its own as the protocol wants; with the accounts indexed
+// by email the rates don't depend on how many accounts there are
+int main(int argc, char *argv[]){
+    bool generate = false;
+    int conn_s;
+    int opt;
+
+    while((opt = getopt(argc, argv, "p:a:c:d:n:g")) != -1){
+        switch(opt){
+            case 'p':
+                port = strtol(optarg, NULL, 10);
+                break;
+
+            case 'a':
+                address = optarg;
+                break;
+
+            case 'c':
+                clients_count = strtol(optarg, NULL, 10);
+                break;
+
+            case 'd':
+                seconds = strtol(optarg, NULL, 10);
+                break;
+
+            case 'n':
+                accounts = strtol(optarg, NULL, 10);
+                break;
+
+            case 'g':
+                generate = true;
+                break;
+
+            default:
+                fprintf(stderr, "%s\n", ACCOUNTS_USAGE);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if(port < 1024 || port > 65535 || clients_count < 1 || clients_count > MAX_CLIENTS || seconds < 1 || accounts < 1){
+        fprintf(stderr, "%s\n", ACCOUNTS_USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    // the accounts file of the server: nickname, email and password
+    if(generate){
+        for(long k=0; k<accounts; k++)
+            printf("tester;account%ld@bench.it;password1\n", k);
+        return 0;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // a million accounts take a while to load
+    for(int i=0; (conn_s = test_connect(address, port)) == -1; i++){
+        if(i == STARTUP_WAIT * 10){
+            fprintf(stderr, "accounts: no server at %s:%ld\n", address, port);
+            exit(EXIT_FAILURE);
+        }
+        usleep(100000);
+    }
+
+    close(conn_s);
+
+    if((clients = calloc(clients_count, sizeof(client_t))) == NULL){
+        perror("accounts: memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-8s %12s %12s %12s\n", "accounts", "clients", "sign ins/s", "sign ups/s");
+    printf("%-8ld %12d %12.0f", accounts, clients_count, run_phase(false));
+    fflush(stdout);
+    printf(" %12.0f\n", run_phase(true));
+
+    return 0;
+}
+
+
+
+
+// accesses per second of the clients
+double run_phase(bool phase){
+    unsigned long done = 0;
+    struct timespec start, end;
+
+    signing_up = phase;
+    stop = false;
+    pthread_barrier_init(&ready, NULL, clients_count + 1);
+
+    for(int i=0; i<clients_count; i++){
+        clients[i].index = i;
+        clients[i].done = 0;
+
+        if(pthread_create(&clients[i].tid, NULL, client_func, &clients[i]) != 0){
+            perror("accounts: client creation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&ready);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    sleep(seconds);
+    __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+
+    for(int i=0; i<clients_count; i++){
+        pthread_join(clients[i].tid, NULL);
+        done += clients[i].done;
+
+        if(clients[i].failed){
+            fprintf(stderr, "accounts: client %d was refused or lost its connection\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_barrier_destroy(&ready);
+
+    return done / (end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+
+
+
+void *client_func(void *arg){
+    client_t *self = (client_t *) arg;
+    unsigned int seed = self->index + 1;
+
+    pthread_barrier_wait(&ready);
+
+    while(!self->failed && !__atomic_load_n(&stop, __ATOMIC_ACQUIRE)){
+        if(!access_once(self, signing_up ? self->done : ((unsigned long) rand_r(&seed) * RAND_MAX + rand_r(&seed)) % accounts))
+            self->failed = true;
+        else
+            self->done++;
+    }
+
+    return NULL;
+}
+
+
+
+
+// signs in to the k-th account of the file, or up to the client's k-th new
+// one; the server closes first, so that the client's ports aren't left in TIME_WAIT
+bool access_once(client_t *self, unsigned long k){
+    char email[MAX_INPUT_SIZE];
+    char eof;
+    bool ok;
+    int conn_s;
+
+    if(signing_up)
+        snprintf(email, sizeof(email), "new%d.%d.%lu@bench.it", getpid(), self->index, k);
+    else
+        snprintf(email, sizeof(email), "account%lu@bench.it", k);
+
+    if((conn_s = test_connect(address, port)) == -1)
+        return false;
+
+    ok = signing_up ? test_sign_up(conn_s, email) : test_sign_in(conn_s, email);
+
+    test_send_frame(conn_s, FRAME_BYE, NULL, 0);
+    recv(conn_s, &eof, sizeof(eof), 0);
+    close(conn_s);
+
+    return ok;
+}
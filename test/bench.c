@@ -0,0 +1,390 @@
+#include "test.h"
+
+#define BENCH_USAGE "USAGE: ./bench [-p <PORT_NUMBER>] [-a <SERVER_ADDRESS>] [-c <MAX_CLIENTS>] [-d <SECONDS>] [-s] [-o] [-r]"
+#define MAX_CLIENTS 1024
+
+
+typedef struct client{
+    pthread_t tid;
+    int index;
+    int conn_s;                             // v2: the client's session
+    char email[MAX_INPUT_SIZE];
+    unsigned long attempts;
+    unsigned long booked;
+    bool failed;
+} client_t;
+
+
+void *client_func(void *arg);
+bool hall_size();
+bool book_and_cancel(client_t *self, int seat);
+bool reconnect(client_t *self);
+int original_access(int type, const char *email);
+bool original_book_and_cancel(client_t *self, int seat);
+void run_round(int count);
+
+
+// global variables
+char *address = "127.0.0.1";
+long port = DEFAULT_PORT;
+int max_clients = 32;
+int seconds = 5;
+bool same_row = false;                      // the clients fight over the first row instead of one each
+bool original = false;                      // the protocol of the first release, for comparisons
+bool reconnecting = false;                  // v2: a connection for each operation, signing in again
+int n, m;                                   // # rows and cols of the hall
+client_t *clients;
+pthread_barrier_t ready;                    // the clock starts once every client is signed up
+volatile bool stop = false;
+
+
+
+
+// each client books a seat and cancels it again, as fast as it can; by
+// default each one in a row of its own, so that they don't conflict and
+// only the locking of the server can make them wait for one another;
+// with -r each operation pays for a connection and a sign in of its own
+int main(int argc, char *argv[]){
+    int opt;
+
+    while((opt = getopt(argc, argv, "p:a:c:d:sor")) != -1){
+        switch(opt){
+            case 'p':
+                port = strtol(optarg, NULL, 10);
+                break;
+
+            case 'a':
+                address = optarg;
+                break;
+
+            case 'c':
+                max_clients = strtol(optarg, NULL, 10);
+                break;
+
+            case 'd':
+                seconds = strtol(optarg, NULL, 10);
+                break;
+
+            case 's':
+                same_row = true;
+                break;
+
+            case 'o':
+                original = true;
+                break;
+
+            case 'r':
+                reconnecting = true;
+                break;
+
+            default:
+                fprintf(stderr, "%s\n", BENCH_USAGE);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if(port < 1024 || port > 65535 || max_clients < 1 || max_clients > MAX_CLIENTS || seconds < 1){
+        fprintf(stderr, "%s\n", BENCH_USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    // a closed connection is an error of the round, not the end of the program
+    signal(SIGPIPE, SIG_IGN);
+
+    if(!hall_size()){
+        fprintf(stderr, "bench: no server at %s:%ld\n", address, port);
+        exit(EXIT_FAILURE);
+    }
+
+    if((clients = calloc(max_clients, sizeof(client_t))) == NULL){
+        perror("bench: memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if(!same_row && max_clients > n)
+        printf("bench: %d rows for %d clients, some of them share a row\n", n, max_clients);
+
+    printf("%-8s %12s %12s %10s\n", "clients", "bookings/s", "attempts/s", "per client");
+
+    for(int count=1; count<=max_clients; count*=2)
+        run_round(count);
+
+    return 0;
+}
+
+
+
+
+// reads the size of the hall, with an account of its own
+bool hall_size(){
+    char email[MAX_INPUT_SIZE];
+    char sizes[2 * 10 + 1] = {0};
+    char field[16] = {0};
+    uint64_t version;
+    char *map = NULL;
+    bool found = false;
+    int conn_s;
+
+    snprintf(email, sizeof(email), "bench%d.hall@bench.it", getpid());
+
+    if(!original){
+        if((conn_s = test_connect(address, port)) == -1)
+            return false;
+
+        if(test_sign_up(conn_s, email) && (map = test_map(conn_s, &n, &m, &version)) != NULL)
+            found = true;
+
+        free(map);
+        close(conn_s);
+        return found;
+    }
+
+    // the first release sends the sizes, then the map, on the way to a booking
+    if((conn_s = original_access(WANT_TO_SIGN_UP, email)) == -1)
+        return false;
+
+    if(write(conn_s, "1", sizeof(char)) == sizeof(char) && recv(conn_s, sizes, 2 * 10, MSG_WAITALL) == 2 * 10){
+        n = atoi(sizes);
+        m = atoi(sizes + 10);
+
+        if(n > 0 && m > 0 && (map = malloc(n * m)) != NULL && recv(conn_s, map, n * m, MSG_WAITALL) == n * m){
+            // no seats, the server lets the connection go
+            field[0] = '0';
+            write(conn_s, field, (log10(n * m) + 2) * sizeof(char));
+            found = true;
+        }
+    }
+
+    free(map);
+    close(conn_s);
+    return found;
+}
+
+
+
+
+void run_round(int count){
+    unsigned long attempts = 0, booked = 0;
+    struct timespec start, end;
+    double elapsed;
+
+    pthread_barrier_init(&ready, NULL, count + 1);
+    stop = false;
+
+    for(int i=0; i<count; i++){
+        clients[i].index = i;
+        clients[i].attempts = clients[i].booked = 0;
+
+        if(pthread_create(&clients[i].tid, NULL, client_func, &clients[i]) != 0){
+            perror("bench: client creation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&ready);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    sleep(seconds);
+    __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+
+    for(int i=0; i<count; i++){
+        pthread_join(clients[i].tid, NULL);
+        attempts += clients[i].attempts;
+        booked += clients[i].booked;
+
+        if(clients[i].failed){
+            fprintf(stderr, "bench: client %d lost its connection\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%-8d %12.0f %12.0f %10.0f\n", count, booked / elapsed, attempts / elapsed, booked / elapsed / count);
+    fflush(stdout);
+
+    pthread_barrier_destroy(&ready);
+}
+
+
+
+
+void *client_func(void *arg){
+    client_t *self = (client_t *) arg;
+    unsigned int seed = self->index + 1;
+    int row = same_row ? 0 : self->index % n;
+    int seat;
+
+    // the accounts are made once, the rounds after the first sign in again
+    snprintf(self->email, sizeof(self->email), "bench%d.%d@bench.it", getpid(), self->index);
+
+    if(original){
+        if((self->conn_s = original_access(WANT_TO_SIGN_UP, self->email)) != -1)
+            close(self->conn_s);
+        self->conn_s = -1;
+    } else if((self->conn_s = test_connect(address, port)) == -1 || !test_sign_up(self->conn_s, self->email)){
+        // signed up in an earlier round
+        if(self->conn_s == -1 || !test_sign_in(self->conn_s, self->email))
+            self->failed = true;
+    }
+
+    pthread_barrier_wait(&ready);
+
+    while(!self->failed && !__atomic_load_n(&stop, __ATOMIC_ACQUIRE)){
+        seat = row * m + 1 + (same_row ? rand_r(&seed) % m : (int) (self->attempts % m));
+        self->attempts++;
+
+        if(!(original ? original_book_and_cancel(self, seat) : book_and_cancel(self, seat)))
+            self->failed = true;
+    }
+
+    if(self->conn_s != -1){
+        test_send_frame(self->conn_s, FRAME_BYE, NULL, 0);
+        close(self->conn_s);
+    }
+
+    return NULL;
+}
+
+
+
+
+// false if the connection is broken
+bool book_and_cancel(client_t *self, int seat){
+    char code[CODE_SIZE];
+    int result;
+
+    if((reconnecting && !reconnect(self)) || (result = test_book(self->conn_s, 0, &seat, 1, code)) == -1)
+        return false;
+
+    if(result != BOOK_RESULT_BOOKED)
+        return true;
+
+    self->booked++;
+    return (!reconnecting || reconnect(self)) && test_cancel(self->conn_s, code);
+}
+
+
+
+
+// says goodbye and opens a new session; the server closes first, so that
+// the client's ports aren't left in TIME_WAIT
+bool reconnect(client_t *self){
+    char eof;
+
+    test_send_frame(self->conn_s, FRAME_BYE, NULL, 0);
+    recv(self->conn_s, &eof, sizeof(eof), 0);
+    close(self->conn_s);
+
+    return (self->conn_s = test_connect(address, port)) != -1 && test_sign_in(self->conn_s, self->email);
+}
+
+
+
+
+// the first release takes a connection for each operation, opened signing up
+// or in; the fields have a fixed size, the strings are padded with '\0'
+int original_access(int type, const char *email){
+    struct sockaddr_in servaddr;
+    char fields[3][MAX_INPUT_SIZE] = {{0}};
+    char answer[1 + MAX_INPUT_SIZE];
+    int optval = 1;
+    int conn_s;
+
+    strncpy(fields[0], email, MAX_INPUT_SIZE - 1);
+    strcpy(fields[1], "tester");
+    strcpy(fields[2], "password1");
+
+    if((conn_s = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(port);
+
+    if(inet_aton(address, &servaddr.sin_addr) == 0 || connect(conn_s, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0){
+        close(conn_s);
+        return -1;
+    }
+
+    setsockopt(conn_s, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+    // the access type, the email, the nickname only to sign up, the password
+    if(write(conn_s, type == WANT_TO_SIGN_UP ? "2" : "1", sizeof(char)) != sizeof(char) ||
+        write(conn_s, fields[0], MAX_INPUT_SIZE) != MAX_INPUT_SIZE ||
+        (type == WANT_TO_SIGN_UP && write(conn_s, fields[1], MAX_INPUT_SIZE) != MAX_INPUT_SIZE) ||
+        write(conn_s, fields[2], MAX_INPUT_SIZE) != MAX_INPUT_SIZE ||
+        recv(conn_s, answer, sizeof(char), MSG_WAITALL) != sizeof(char) || answer[0] != '1' ||
+        (type == WANT_TO_SIGN_IN && recv(conn_s, answer + 1, MAX_INPUT_SIZE, MSG_WAITALL) != MAX_INPUT_SIZE)){
+        close(conn_s);
+        return -1;
+    }
+
+    return conn_s;
+}
+
+
+
+
+bool original_book_and_cancel(client_t *self, int seat){
+    ssize_t seat_size = (log10(n * m) + 2) * sizeof(char);
+    char field[16] = {0};
+    char code[CODE_SIZE];
+    char *map;
+    char state;
+    char result[2];
+    int conn_s;
+
+    if((map = malloc(2 * 10 + n * m)) == NULL)
+        return false;
+
+    if((conn_s = original_access(WANT_TO_SIGN_IN, self->email)) == -1 ||
+        write(conn_s, "1", sizeof(char)) != sizeof(char) ||                                 // book
+        recv(conn_s, map, 2 * 10 + n * m, MSG_WAITALL) != 2 * 10 + n * m){
+        free(map);
+        return false;
+    }
+
+    free(map);
+
+    // the number of seats and the seat, each one as long as the largest seat
+    snprintf(field, sizeof(field), "%d", 1);
+    if(write(conn_s, field, seat_size) != seat_size)
+        return false;
+
+    snprintf(field, sizeof(field), "%d", seat);
+    if(write(conn_s, field, seat_size) != seat_size)
+        return false;
+
+    // '0' while waiting for the hall, '1' once it is taken
+    do{
+        if(recv(conn_s, &state, sizeof(char), MSG_WAITALL) != sizeof(char))
+            return false;
+    } while(state == '0');
+
+    if(recv(conn_s, result, sizeof(result), MSG_WAITALL) != sizeof(result))
+        return false;
+
+    if(result[0] != '0'){
+        write(conn_s, "n", sizeof(char));
+        close(conn_s);
+        return true;
+    }
+
+    if(recv(conn_s, code, CODE_SIZE, MSG_WAITALL) != CODE_SIZE)
+        return false;
+
+    close(conn_s);
+    self->booked++;
+
+    if((conn_s = original_access(WANT_TO_SIGN_IN, self->email)) == -1 ||
+        write(conn_s, "2", sizeof(char)) != sizeof(char) ||                                 // cancel
+        write(conn_s, code, CODE_SIZE) != CODE_SIZE ||
+        recv(conn_s, &state, sizeof(char), MSG_WAITALL) != sizeof(char)){
+        return false;
+    }
+
+    close(conn_s);
+    return true;
+}
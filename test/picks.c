@@ -0,0 +1,148 @@
+#include "test.h"
+
+#define PICKS_USAGE "USAGE: ./picks [-p <PORT_NUMBER>] [-a <SERVER_ADDRESS>] [-d <SECONDS>] [-k <SEATS>]"
+#define FILL_BATCH 1000                     // seats of each booking filling the hall, within a frame
+
+
+bool fill_hall(int conn_s);
+void measure(int conn_s, const char *label, bool adjacent, int expected_row);
+
+
+// global variables
+char *address = "127.0.0.1";
+long port = DEFAULT_PORT;
+int seconds = 2;
+int count = 4;                              // seats of each pick
+int n, m;                                   // # rows and cols of the hall
+
+
+
+
+// one client lets the server pick seats and cancels them again, to time
+// the search alone: first in the empty hall, where the middle row has
+// them, then with every count-th seat taken but in the first row, so
+// that the adjacent seats are only there and the rows are skipped by
+// their longest free run, and the seats anywhere are found at once
+int main(int argc, char *argv[]){
+    char email[MAX_INPUT_SIZE];
+    uint64_t version;
+    char *map;
+    int conn_s;
+    int opt;
+
+    while((opt = getopt(argc, argv, "p:a:d:k:")) != -1){
+        switch(opt){
+            case 'p':
+                port = strtol(optarg, NULL, 10);
+                break;
+
+            case 'a':
+                address = optarg;
+                break;
+
+            case 'd':
+                seconds = strtol(optarg, NULL, 10);
+                break;
+
+            case 'k':
+                count = strtol(optarg, NULL, 10);
+                break;
+
+            default:
+                fprintf(stderr, "%s\n", PICKS_USAGE);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if(port < 1024 || port > 65535 || seconds < 1 || count < 2 || count > FILL_BATCH){
+        fprintf(stderr, "%s\n", PICKS_USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(email, sizeof(email), "picks%d@bench.it", getpid());
+
+    if((conn_s = test_connect(address, port)) == -1 || !test_sign_up(conn_s, email) || (map = test_map(conn_s, &n, &m, &version)) == NULL){
+        fprintf(stderr, "picks: no server at %s:%ld\n", address, port);
+        exit(EXIT_FAILURE);
+    }
+
+    if(strchr(map, '1') != NULL || n < 2 || m < count){
+        fprintf(stderr, "picks: the hall must be empty, with at least 2 rows of %d seats\n", count);
+        exit(EXIT_FAILURE);
+    }
+
+    free(map);
+
+    printf("%dx%d hall, %d seats a pick\n", n, m, count);
+    printf("%-40s %12s %12s\n", "case", "picks/s", "us a pick");
+
+    measure(conn_s, "empty hall, side by side", true, -1);
+
+    if(!fill_hall(conn_s)){
+        fprintf(stderr, "picks: the hall couldn't be filled\n");
+        exit(EXIT_FAILURE);
+    }
+
+    measure(conn_s, "filled but the first row, side by side", true, 0);
+    measure(conn_s, "filled but the first row, anywhere", false, -1);
+
+    test_send_frame(conn_s, FRAME_BYE, NULL, 0);
+    close(conn_s);
+
+    return 0;
+}
+
+
+
+
+// takes every count-th seat of the rows after the first one, so that
+// their longest free runs are a seat too short
+bool fill_hall(int conn_s){
+    int seats[FILL_BATCH];
+    char code[CODE_SIZE];
+    int filled = 0;
+
+    for(int row=1; row<n; row++){
+        for(int col=count-1; col<m; col+=count){
+            seats[filled++] = row * m + col + 1;
+
+            if(filled == FILL_BATCH || (row == n - 1 && col + count >= m)){
+                if(test_book(conn_s, 0, seats, filled, code) != BOOK_RESULT_BOOKED)
+                    return false;
+                filled = 0;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+
+
+// picks and cancels for the given seconds, checking the row of the seats
+// when expected_row isn't -1
+void measure(int conn_s, const char *label, bool adjacent, int expected_row){
+    struct timespec start, now;
+    char code[CODE_SIZE];
+    int seats[FILL_BATCH];
+    unsigned long picks = 0;
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    do{
+        if(test_book_best(conn_s, count, adjacent, code, seats) != BOOK_RESULT_BOOKED || !test_cancel(conn_s, code) ||
+            (expected_row != -1 && (seats[0] - 1) / m != expected_row)){
+            fprintf(stderr, "picks: %s: wrong pick\n", label);
+            exit(EXIT_FAILURE);
+        }
+
+        picks++;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = now.tv_sec - start.tv_sec + (now.tv_nsec - start.tv_nsec) / 1e9;
+    } while(elapsed < seconds);
+
+    printf("%-40s %12.0f %12.1f\n", label, picks / elapsed, elapsed * 1e6 / picks);
+    fflush(stdout);
+}
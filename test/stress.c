@@ -0,0 +1,279 @@
+#include "test.h"
+
+#define STRESS_USAGE "USAGE: ./stress [-p <PORT_NUMBER>] [-a <SERVER_ADDRESS>] [-c <CLIENTS>] [-r <ROUNDS>]"
+#define MAX_CLIENTS 1024
+#define MAX_SEATS_PER_BOOKING 3
+#define CANCEL_ONE_IN 4                     // a client cancels one of its bookings every few rounds
+
+
+// a booking still held by the client that made it
+typedef struct held{
+    char code[CODE_SIZE];
+    int seats[MAX_SEATS_PER_BOOKING];
+    int count;
+} held_t;
+
+
+typedef struct client{
+    pthread_t tid;
+    int index;
+    held_t *held;                           // at most one booking for each round
+    int held_count;
+    unsigned long attempts;
+    unsigned long booked;
+    unsigned long cancelled;
+    bool failed;                            // the server broke the connection or answered wrongly
+} client_t;
+
+
+void *client_func(void *arg);
+char *read_map(const char *name);
+bool check_bookings(const char *initial, const char *final);
+
+
+// global variables
+char *address = "127.0.0.1";
+long port = DEFAULT_PORT;
+int clients_count = 64;
+int rounds = 200;
+int n, m;                                   // # rows and cols of the hall
+client_t *clients;
+
+
+
+
+// many clients book and cancel random seats of a small hall at once:
+// in the end no seat may belong to two bookings, and the seats taken
+// must be exactly the ones taken before and the ones still booked
+int main(int argc, char *argv[]){
+    char *initial;
+    char *final;
+    int opt;
+    bool failed = false;
+
+    while((opt = getopt(argc, argv, "p:a:c:r:")) != -1){
+        switch(opt){
+            case 'p':
+                port = strtol(optarg, NULL, 10);
+                break;
+
+            case 'a':
+                address = optarg;
+                break;
+
+            case 'c':
+                clients_count = strtol(optarg, NULL, 10);
+                break;
+
+            case 'r':
+                rounds = strtol(optarg, NULL, 10);
+                break;
+
+            default:
+                fprintf(stderr, "%s\n", STRESS_USAGE);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if(port < 1024 || port > 65535 || clients_count < 1 || clients_count > MAX_CLIENTS || rounds < 1){
+        fprintf(stderr, "%s\n", STRESS_USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    // the seats taken before are left alone
+    if((initial = read_map("initial")) == NULL){
+        fprintf(stderr, "stress: no server at %s:%ld\n", address, port);
+        exit(EXIT_FAILURE);
+    }
+
+    if((clients = calloc(clients_count, sizeof(client_t))) == NULL){
+        perror("stress: memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for(int i=0; i<clients_count; i++){
+        clients[i].index = i;
+
+        if((clients[i].held = malloc(rounds * sizeof(held_t))) == NULL){
+            perror("stress: memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+
+        if(pthread_create(&clients[i].tid, NULL, client_func, &clients[i]) != 0){
+            perror("stress: client creation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for(int i=0; i<clients_count; i++){
+        pthread_join(clients[i].tid, NULL);
+        failed |= clients[i].failed;
+    }
+
+    if((final = read_map("final")) == NULL){
+        fprintf(stderr, "stress: the final map can't be read\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(failed)
+        fprintf(stderr, "stress: some clients lost their connection\n");
+
+    if(!check_bookings(initial, final) || failed)
+        exit(EXIT_FAILURE);
+
+    return 0;
+}
+
+
+
+
+// the map of the hall, read by an account of its own
+char *read_map(const char *name){
+    char email[MAX_INPUT_SIZE];
+    uint64_t version;
+    char *map = NULL;
+    int conn_s;
+
+    snprintf(email, sizeof(email), "stress%d.%ld.%s@stress.it", getpid(), (long) time(NULL), name);
+
+    if((conn_s = test_connect(address, port)) == -1)
+        return NULL;
+
+    if(test_sign_up(conn_s, email))
+        map = test_map(conn_s, &n, &m, &version);
+
+    close(conn_s);
+    return map;
+}
+
+
+
+
+// books 1 to MAX_SEATS_PER_BOOKING random seats each round, with no
+// map in hand, and sometimes cancels one of the bookings it holds
+void *client_func(void *arg){
+    client_t *self = (client_t *) arg;
+    unsigned int seed = time(NULL) ^ (self->index * 2654435761u);
+    char email[MAX_INPUT_SIZE];
+    held_t *booking;
+    int conn_s;
+    int result;
+    int victim;
+
+    snprintf(email, sizeof(email), "stress%d.%ld.%d@stress.it", getpid(), (long) time(NULL), self->index);
+
+    if((conn_s = test_connect(address, port)) == -1 || !test_sign_up(conn_s, email)){
+        self->failed = true;
+        return NULL;
+    }
+
+    for(int r=0; r<rounds; r++){
+        booking = &self->held[self->held_count];
+        booking->count = 1 + rand_r(&seed) % MAX_SEATS_PER_BOOKING;
+
+        if(booking->count > n * m)
+            booking->count = n * m;
+
+        // distinct seats, the server refuses the repeated ones
+        for(int i=0; i<booking->count; i++){
+            booking->seats[i] = 1 + rand_r(&seed) % (n * m);
+
+            for(int j=0; j<i; j++){
+                if(booking->seats[j] == booking->seats[i]){
+                    i--;
+                    break;
+                }
+            }
+        }
+
+        self->attempts++;
+
+        if((result = test_book(conn_s, 0, booking->seats, booking->count, booking->code)) == -1){
+            self->failed = true;
+            break;
+        }
+
+        if(result == BOOK_RESULT_BOOKED){
+            self->booked++;
+            self->held_count++;
+        }
+
+        if(self->held_count > 0 && rand_r(&seed) % CANCEL_ONE_IN == 0){
+            victim = rand_r(&seed) % self->held_count;
+
+            if(!test_cancel(conn_s, self->held[victim].code)){
+                self->failed = true;
+                break;
+            }
+
+            self->cancelled++;
+            self->held[victim] = self->held[--self->held_count];
+        }
+    }
+
+    test_send_frame(conn_s, FRAME_BYE, NULL, 0);
+    close(conn_s);
+
+    return NULL;
+}
+
+
+
+
+bool check_bookings(const char *initial, const char *final){
+    int *owner;                             // client holding each seat, -1 if none
+    unsigned long attempts = 0, booked = 0, cancelled = 0;
+    int held = 0;
+    int oversold = 0;
+    int mismatches = 0;
+    int seat;
+
+    if((owner = malloc(n * m * sizeof(int))) == NULL){
+        perror("stress: memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for(int i=0; i<n*m; i++)
+        owner[i] = initial[i] == '1' ? clients_count : -1;
+
+    for(int c=0; c<clients_count; c++){
+        attempts += clients[c].attempts;
+        booked += clients[c].booked;
+        cancelled += clients[c].cancelled;
+
+        for(int b=0; b<clients[c].held_count; b++){
+            for(int i=0; i<clients[c].held[b].count; i++){
+                seat = clients[c].held[b].seats[i] - 1;
+                held++;
+
+                if(owner[seat] != -1){
+                    printf("stress: seat %d sold twice, booking %.*s\n", seat + 1, CODE_SIZE, clients[c].held[b].code);
+                    oversold++;
+                }
+
+                owner[seat] = c;
+            }
+        }
+    }
+
+    // a seat taken by nobody, or free while booked
+    for(int i=0; i<n*m; i++){
+        if((final[i] == '1') != (owner[i] != -1)){
+            printf("stress: seat %d is %s in the map\n", i + 1, final[i] == '1' ? "taken" : "free");
+            mismatches++;
+        }
+    }
+
+    printf("stress: %d clients on %dx%d seats, %lu attempts, %lu booked, %lu cancelled, %d seats held\n",
+        clients_count, n, m, attempts, booked, cancelled, held);
+
+    free(owner);
+
+    if(oversold > 0 || mismatches > 0){
+        printf("stress: FAILED, %d seats sold twice, %d seats out of place\n", oversold, mismatches);
+        return false;
+    }
+
+    puts("stress: no seat sold twice");
+    return true;
+}
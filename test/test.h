@@ -0,0 +1,265 @@
+#pragma once
+
+#include "../utils/utils.h"
+
+
+// the programs in this folder are clients of a running server: each
+// connection speaks v2 and gets the seats map raw, a '0'/'1' per seat
+
+
+extern int test_connect(const char *address, long port){
+    struct sockaddr_in servaddr;
+    char hello[1 + FRAME_HEADER_SIZE + 2];
+    char answer[FRAME_HEADER_SIZE + 2];
+    char *payload;
+    int optval = 1;
+    int conn_s;
+
+    if((conn_s = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(port);
+
+    if(inet_aton(address, &servaddr.sin_addr) == 0 || connect(conn_s, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0){
+        close(conn_s);
+        return -1;
+    }
+
+    setsockopt(conn_s, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+    hello[0] = PROTOCOL_MAGIC;
+    payload = put_frame_header(hello + 1, FRAME_HELLO, 2 * sizeof(char));
+    payload[0] = PROTOCOL_V2;
+    payload[1] = MAP_ENCODING_RAW;
+
+    if(write(conn_s, hello, sizeof(hello)) != sizeof(hello) ||
+        recv(conn_s, answer, sizeof(answer), MSG_WAITALL) != sizeof(answer) ||
+        answer[0] != FRAME_HELLO || answer[FRAME_HEADER_SIZE] != PROTOCOL_V2){
+        close(conn_s);
+        return -1;
+    }
+
+    return conn_s;
+}
+
+
+
+extern bool test_send_frame(int conn_s, int type, const char *payload, uint32_t len){
+    char header[FRAME_HEADER_SIZE];
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = FRAME_HEADER_SIZE },
+        { .iov_base = (void *) payload, .iov_len = len }
+    };
+
+    put_frame_header(header, type, len);
+
+    return writev(conn_s, iov, 2) == (ssize_t) (FRAME_HEADER_SIZE + len);
+}
+
+
+
+// returns the payload, to be freed, NULL if the connection is broken
+extern char *test_receive_frame(int conn_s, int *type, uint32_t *len){
+    char header[FRAME_HEADER_SIZE];
+    char *payload;
+
+    if(recv(conn_s, header, FRAME_HEADER_SIZE, MSG_WAITALL) != FRAME_HEADER_SIZE)
+        return NULL;
+
+    *type = (unsigned char) header[0];
+    *len = get_u32(header + 1);
+
+    if((payload = malloc(*len + 1)) == NULL)
+        return NULL;
+
+    if(*len > 0 && recv(conn_s, payload, *len, MSG_WAITALL) != (ssize_t) *len){
+        free(payload);
+        return NULL;
+    }
+
+    return payload;
+}
+
+
+
+extern bool test_sign_up(int conn_s, const char *email){
+    char frame[3 * (sizeof(uint16_t) + MAX_INPUT_SIZE)];
+    char *end;
+    char *answer;
+    uint32_t len;
+    int type;
+    bool ok;
+
+    end = put_str(frame, email);
+    end = put_str(end, "tester");
+    end = put_str(end, "password1");
+
+    if(!test_send_frame(conn_s, FRAME_SIGN_UP, frame, end - frame) || (answer = test_receive_frame(conn_s, &type, &len)) == NULL)
+        return false;
+
+    ok = type == FRAME_ACCESS && len >= 1 && answer[0] == 1;
+    free(answer);
+
+    return ok;
+}
+
+
+
+extern bool test_sign_in(int conn_s, const char *email){
+    char frame[2 * (sizeof(uint16_t) + MAX_INPUT_SIZE)];
+    char *end;
+    char *answer;
+    uint32_t len;
+    int type;
+    bool ok;
+
+    end = put_str(frame, email);
+    end = put_str(end, "password1");
+
+    if(!test_send_frame(conn_s, FRAME_SIGN_IN, frame, end - frame) || (answer = test_receive_frame(conn_s, &type, &len)) == NULL)
+        return false;
+
+    ok = type == FRAME_ACCESS && len >= 1 && answer[0] == 1;
+    free(answer);
+
+    return ok;
+}
+
+
+
+// the map as a '0'/'1' string, to be freed, with its size and version
+extern char *test_map(int conn_s, int *n, int *m, uint64_t *version){
+    char *payload;
+    char *map;
+    uint32_t len;
+    size_t header = 2 * sizeof(uint32_t) + sizeof(uint64_t) + sizeof(char);
+    int type;
+
+    if(!test_send_frame(conn_s, FRAME_MAP_REQUEST, NULL, 0) || (payload = test_receive_frame(conn_s, &type, &len)) == NULL)
+        return NULL;
+
+    if(type != FRAME_MAP || len < header || payload[header - 1] != MAP_ENCODING_RAW){
+        free(payload);
+        return NULL;
+    }
+
+    *n = get_u32(payload);
+    *m = get_u32(payload + sizeof(uint32_t));
+    *version = get_u64(payload + 2 * sizeof(uint32_t));
+
+    if(len - header != (size_t) *n * *m || (map = malloc(len - header + 1)) == NULL){
+        free(payload);
+        return NULL;
+    }
+
+    memcpy(map, payload + header, len - header);
+    map[len - header] = '\0';
+    free(payload);
+
+    return map;
+}
+
+
+
+// returns the result of the booking, -1 if the connection is broken; the
+// code is filled in once booked
+extern int test_book(int conn_s, uint64_t version, const int *seats, int count, char *code){
+    char frame[sizeof(uint64_t) + sizeof(uint32_t) * (1 + count)];
+    char *end;
+    char *answer;
+    uint32_t len;
+    int type;
+    int result;
+
+    end = put_u64(frame, version);
+    end = put_u32(end, count);
+    for(int i=0; i<count; i++)
+        end = put_u32(end, seats[i]);
+
+    if(!test_send_frame(conn_s, FRAME_BOOK, frame, end - frame))
+        return -1;
+
+    // the queue states come before the result
+    while((answer = test_receive_frame(conn_s, &type, &len)) != NULL && type == FRAME_QUEUE)
+        free(answer);
+
+    if(answer == NULL || type != FRAME_RESULT || len < 1){
+        free(answer);
+        return -1;
+    }
+
+    if((result = answer[0]) == BOOK_RESULT_BOOKED){
+        if(len < 1 + CODE_SIZE){
+            free(answer);
+            return -1;
+        }
+
+        memcpy(code, answer + 1, CODE_SIZE);
+    }
+
+    free(answer);
+    return result;
+}
+
+
+
+// the server picks the seats, anywhere in the hall: returns the result
+// as test_book(), and the seats too once booked
+extern int test_book_best(int conn_s, int count, bool adjacent, char *code, int *seats){
+    char frame[3 * sizeof(uint32_t) + sizeof(char)];
+    char *end;
+    char *answer;
+    uint32_t len;
+    int type;
+    int result;
+
+    end = put_u32(frame, count);
+    *end++ = adjacent;
+    end = put_u32(end, 0);
+    end = put_u32(end, 0);
+
+    if(!test_send_frame(conn_s, FRAME_BOOK_BEST, frame, end - frame))
+        return -1;
+
+    while((answer = test_receive_frame(conn_s, &type, &len)) != NULL && type == FRAME_QUEUE)
+        free(answer);
+
+    if(answer == NULL || type != FRAME_RESULT || len < 1){
+        free(answer);
+        return -1;
+    }
+
+    if((result = answer[0]) == BOOK_RESULT_BOOKED){
+        if(len != 1 + CODE_SIZE + sizeof(uint32_t) * (1 + count) || get_u32(answer + 1 + CODE_SIZE) != (uint32_t) count){
+            free(answer);
+            return -1;
+        }
+
+        memcpy(code, answer + 1, CODE_SIZE);
+        for(int i=0; i<count; i++)
+            seats[i] = get_u32(answer + 1 + CODE_SIZE + sizeof(uint32_t) * (1 + i));
+    }
+
+    free(answer);
+    return result;
+}
+
+
+
+// returns whether the booking was cancelled, false also if the connection is broken
+extern bool test_cancel(int conn_s, const char *code){
+    char *answer;
+    uint32_t len;
+    int type;
+    bool removed;
+
+    if(!test_send_frame(conn_s, FRAME_CANCEL, code, CODE_SIZE) || (answer = test_receive_frame(conn_s, &type, &len)) == NULL)
+        return false;
+
+    removed = type == FRAME_CANCEL_RESULT && len == 1 && answer[0] != 0;
+    free(answer);
+
+    return removed;
+}
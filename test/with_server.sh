@@ -0,0 +1,30 @@
+#!/bin/sh
+# runs a command against a fresh server of an empty ROWS x COLS hall, started
+# in the hall folder with the given options; its exit status is the command's;
+# the accounts are the ones of the ACCOUNTS file, if set
+# usage: ./with_server.sh <SERVER> <ROWS> <COLS> "<SERVER_OPTIONS>" <COMMAND>...
+
+server=$(realpath "$1"); rows=$2; cols=$3; options=$4
+shift 4
+
+rm -rf hall && mkdir hall || exit 1
+
+# the files of the hall, as the server writes them: no seat taken, no booking
+row=$(printf "%${cols}s" | tr ' ' 0)
+printf "%s;%s;" "$rows" "$cols" > hall/cinema_struct
+for i in $(seq "$rows"); do printf "%s;" "$row" >> hall/cinema_struct; done
+: > hall/booking_struct
+if [ -n "$ACCOUNTS" ]; then cp "$ACCOUNTS" hall/accounts || exit 1; else : > hall/accounts; fi
+
+(cd hall && exec "$server" $options > server.log 2>&1) &
+pid=$!
+sleep 1
+
+echo "== server $options, $*"
+"$@"
+status=$?
+
+kill -INT $pid
+wait $pid 2> /dev/null
+
+exit $status
@@ -1,19 +1,32 @@
 #pragma once
 
+#define _GNU_SOURCE     // CPU affinity of the threads
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/ipc.h>
 #include <sys/sem.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
+#include <setjmp.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <endian.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -34,6 +47,60 @@
 #define WANT_TO_SIGN_IN 1
 #define WANT_TO_SIGN_UP 2
 #define WANT_TO_EXIT 3
+#define QUEUE_FIELD_SIZE 10               // width of the position and estimate fields of a queue state
+#define VERSION_SIZE 20                   // width of the seats map version
+
+
+// protocol v2: the client opens with PROTOCOL_MAGIC, a byte no legacy access
+// type uses, then both sides send frames made of the type (1 byte), the
+// payload length (4 bytes) and the payload; integers are in network order,
+// strings are prefixed by their length (2 bytes) and not '\0' terminated
+#define PROTOCOL_LEGACY 1
+#define PROTOCOL_V2 2
+#define PROTOCOL_MAGIC '\xB2'
+#define FRAME_HEADER_SIZE 5
+#define MAX_FRAME_SIZE 4096               // payload limit of the frames sent to the server
+
+#define FRAME_HELLO 1                     // highest version spoken (1), map encodings decoded (1)
+#define FRAME_SIGN_IN 2                   // email, password
+#define FRAME_SIGN_UP 3                   // email, nickname, password
+#define FRAME_ACCESS 4                    // result (1), nickname if signed in
+#define FRAME_MAP_REQUEST 5               // empty, or the version of the map the client has (8)
+#define FRAME_MAP 6                       // rows (4), columns (4), version (8), encoding (1), encoded map
+#define FRAME_BOOK 7                      // map version (8), seats count (4), seats (4 each)
+#define FRAME_QUEUE 8                     // position (4), estimated wait in ms (4)
+#define FRAME_RESULT 9                    // result (1), booking code if booked
+#define FRAME_CANCEL 10                   // booking code
+#define FRAME_CANCEL_RESULT 11            // result (1)
+#define FRAME_BYE 12                      // empty, accepted at any time
+#define FRAME_MAP_DELTA 13                // rows (4), columns (4), base version (8), version (8),
+                                          // flips (4), seat * 2 + 1 if taken for each flip as varints
+#define FRAME_LIST 14                     // empty
+#define FRAME_BOOKINGS 15                 // bookings (4), then code, show (4), seats count (4) and
+                                          // seats (4 each) for each booking
+#define FRAME_SUBSCRIBE 16                // as FRAME_MAP_REQUEST, then the changes are pushed as deltas;
+                                          // refused with FRAME_UNSUBSCRIBE when the server is full
+#define FRAME_UNSUBSCRIBE 17              // empty, echoed back after the last push
+#define FRAME_BOOK_BEST 18                // seats count (4), adjacent (1), first and last row (4 each, from 1,
+                                          // 0 for the hall's ones): the server picks the seats, the
+                                          // result frame has then also their count (4) and the seats (4 each)
+#define FRAME_SHOWS 19                    // empty; the reply has shows (4), then rows (4), columns (4)
+                                          // and free seats (4) for each show
+#define FRAME_SHOW 20                     // show (4) the next operations work on, from 0; the reply
+                                          // has result (1), refused while subscribed
+#define FRAME_PING 21                     // empty, not answered: a subscribed client silent for
+                                          // PING_INTERVAL sends it, the server closes the silent ones
+#define PING_INTERVAL 30                  // seconds, well within the server's inactivity timeout
+
+#define MAP_ENCODING_RAW 0                // '0'/'1' for each seat, always accepted
+#define MAP_ENCODING_BITMAP 1             // a bit for each seat, set if taken, from the lowest bit
+#define MAP_ENCODING_RLE 2                // lengths of the runs of free and taken seats, alternated
+                                          // starting from a free one, as varints; also a flag
+                                          // of the encodings accepted, as the bitmap
+
+#define BOOK_RESULT_BOOKED 0              // results of a booking, as the legacy write 6
+#define BOOK_RESULT_TAKEN 1
+#define BOOK_RESULT_STALE 2
 
 
 extern long get_long(char * msg){
@@ -94,6 +161,119 @@ extern char * get_string(char *msg, ssize_t size){
 }
 
 
+// writes the header of a frame, returns where its payload starts
+extern char *put_frame_header(char *buf, int type, uint32_t len){
+    buf[0] = type;
+    len = htobe32(len);
+    memcpy(buf + 1, &len, sizeof(len));
+    
+    return buf + FRAME_HEADER_SIZE;
+}
+
+
+
+extern char *put_u32(char *buf, uint32_t value){
+    value = htobe32(value);
+    memcpy(buf, &value, sizeof(value));
+    
+    return buf + sizeof(value);
+}
+
+
+
+extern char *put_u64(char *buf, uint64_t value){
+    value = htobe64(value);
+    memcpy(buf, &value, sizeof(value));
+    
+    return buf + sizeof(value);
+}
+
+
+
+// the string is cut to MAX_INPUT_SIZE - 1 characters
+extern char *put_str(char *buf, const char *string){
+    uint16_t len = strnlen(string, MAX_INPUT_SIZE - 1);
+    uint16_t be = htobe16(len);
+    
+    memcpy(buf, &be, sizeof(be));
+    memcpy(buf + sizeof(be), string, len);
+    
+    return buf + sizeof(be) + len;
+}
+
+
+
+// 7 bits for each byte, from the lowest ones; the highest bit is set
+// on all the bytes but the last one
+extern char *put_varint(char *buf, uint32_t value){
+    while(value >= 0x80){
+        *buf++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *buf++ = value;
+    
+    return buf;
+}
+
+
+
+extern uint32_t get_u32(const char *buf){
+    uint32_t value;
+    
+    memcpy(&value, buf, sizeof(value));
+    return be32toh(value);
+}
+
+
+
+extern uint64_t get_u64(const char *buf){
+    uint64_t value;
+    
+    memcpy(&value, buf, sizeof(value));
+    return be64toh(value);
+}
+
+
+
+// returns where the next field starts, NULL if the varint goes beyond end
+extern const char *get_varint(const char *buf, const char *end, uint32_t *value){
+    *value = 0;
+    
+    for(int shift=0; buf < end && shift < 32; shift += 7){
+        *value |= (uint32_t) (*buf & 0x7F) << shift;
+        
+        if((*buf++ & 0x80) == 0)
+            return buf;
+    }
+    
+    return NULL;
+}
+
+
+
+// copies the string starting at buf into dest, '\0' padded up to
+// MAX_INPUT_SIZE; returns where the next field starts, NULL if the
+// string is too long or goes beyond end
+extern const char *get_str(const char *buf, const char *end, char *dest){
+    uint16_t len;
+    
+    if(end - buf < (long) sizeof(len))
+        return NULL;
+    
+    memcpy(&len, buf, sizeof(len));
+    len = be16toh(len);
+    buf += sizeof(len);
+    
+    if(len >= MAX_INPUT_SIZE || end - buf < len)
+        return NULL;
+    
+    bzero(dest, MAX_INPUT_SIZE);
+    memcpy(dest, buf, len);
+    
+    return buf + len;
+}
+
+
 void get_password(char password[])
 {
     static struct termios oldt, newt;